@@ -0,0 +1,596 @@
+/** Native benchmark harness for the parsing and inference engine.
+
+    Usage:
+      bench gen FAMILY N GRAMMAR_FILE TOKENS_FILE [options]   write a generated grammar and token stream
+      bench run GRAMMAR_FILE TOKENS_FILE [options]            benchmark one grammar and token stream
+      bench suite [options]                                   benchmark every family at several sizes
+
+    Options:
+      --sizes N,N,...   input lengths used by suite (default 64,128,256)
+      --repeat R        runs per phase; times are the median and minimum over runs (default 3)
+      --span L          tokens covered by the constraint phases (default min(N, 24))
+      --seed S          generator seed (default 1)
+      --density D       random family: probability of each binary rule (default 0.05)
+      --nts K           random family: number of nonterminals (default 16)
+      --trace FILE      write the trace-event timeline of the last runs to FILE (PARSIMONY_TRACE builds only)
+
+    A grammar file has one rule per line: "A B C" for the binary rule A -> B C over nonterminals, or "A t" when
+    nonterminal A derives token t. The start symbol is the left-hand side of the first rule, and lines starting with #
+    are comments. A tokens file is a whitespace separated list of tokens.
+
+    Results are printed as JSON: for each phase (init, parse, colorize, constraint, intersect, solve) the median and
+    minimum time, the tokens covered per second, and the peak number of heap bytes allocated through operator new over
+    what was live when the phase started. Builds with PARSIMONY_STATS also report the nonzero counters of stats.h for
+    each phase. The same source builds natively and with emcc (see the bench targets in the Makefile), so that native
+    and asm.js numbers come from the same corpus: the generators only use raw mt19937 output, which is the same on every
+    standard library. */
+
+#include "parser.h"
+#include "inference.h"
+#include "stats.h"
+#include "symbols.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation tracking
+////////////////////////////////////////////////////////////////////////////////
+
+/* Every allocation through operator new is prefixed with its size, so that live and peak heap usage can be measured
+   the same way natively and under asm.js, where there is no rusage. */
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+static const size_t HEADER = 16; // keeps the returned pointer aligned for any fundamental type
+
+/* The allocation functions below all go through these two, which are kept out of line so that the compiler never
+   sees free called on a pointer that came from operator new. */
+__attribute__((noinline)) static void *tracked_alloc(size_t size) noexcept {
+  char *p = (char *)malloc(size + HEADER);
+  if (!p) {
+    return nullptr;
+  }
+  *(size_t *)p = size;
+  live_bytes += size;
+  peak_bytes = std::max(peak_bytes, live_bytes);
+  return p + HEADER;
+}
+
+__attribute__((noinline)) static void tracked_free(void *ptr) noexcept {
+  if (ptr) {
+    char *p = (char *)ptr - HEADER;
+    live_bytes -= *(size_t *)p;
+    free(p);
+  }
+}
+
+void *operator new(size_t size) {
+  void *p = tracked_alloc(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return tracked_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return tracked_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  tracked_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  tracked_free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  tracked_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+  tracked_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  tracked_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  tracked_free(ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Corpus
+////////////////////////////////////////////////////////////////////////////////
+
+/** A grammar and a token stream, by name, as read from or written to files. */
+struct Corpus {
+  std::string name;
+  std::vector<std::vector<std::string> > rules; // {A, B, C} or {A, t}
+  std::vector<std::string> tokens;
+
+  void rule(const std::string &l, const std::string &r1, const std::string &r2) {
+    rules.push_back({l, r1, r2});
+  }
+  void token_rule(const std::string &l, const std::string &t) {
+    rules.push_back({l, t});
+  }
+};
+
+static bool read_corpus(const std::string &grammar_file, const std::string &tokens_file, Corpus &corpus) {
+  std::ifstream grammar(grammar_file), tokens(tokens_file);
+  if (!grammar || !tokens) {
+    return false;
+  }
+  corpus.name = grammar_file;
+  std::string line, word;
+  while (std::getline(grammar, line)) {
+    std::istringstream fields(line);
+    std::vector<std::string> rule;
+    while (fields >> word) {
+      rule.push_back(word);
+    }
+    if (rule.empty() || rule[0][0] == '#') {
+      continue;
+    }
+    if (rule.size() != 2 && rule.size() != 3) {
+      std::cerr << "bench: bad rule in " << grammar_file << ": " << line << std::endl;
+      return false;
+    }
+    corpus.rules.push_back(rule);
+  }
+  while (tokens >> word) {
+    corpus.tokens.push_back(word);
+  }
+  return !corpus.rules.empty() && !corpus.tokens.empty();
+}
+
+static bool write_corpus(Corpus &corpus, const std::string &grammar_file, const std::string &tokens_file) {
+  std::ofstream grammar(grammar_file), tokens(tokens_file);
+  if (!grammar || !tokens) {
+    return false;
+  }
+  grammar << "# " << corpus.name << "\n";
+  for (auto &rule : corpus.rules) {
+    for (size_t k = 0; k < rule.size(); ++k) {
+      grammar << (k ? " " : "") << rule[k];
+    }
+    grammar << "\n";
+  }
+  for (size_t k = 0; k < corpus.tokens.size(); ++k) {
+    tokens << corpus.tokens[k] << ((k + 1) % 32 == 0 ? "\n" : " ");
+  }
+  tokens << "\n";
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Generators
+////////////////////////////////////////////////////////////////////////////////
+
+struct GenOptions {
+  unsigned seed = 1;
+  double density = 0.05;
+  int nts = 16;
+};
+
+/* Uniform in [0, n), from raw generator output only, so that every platform generates the same corpus. */
+static int pick(std::mt19937 &rng, int n) {
+  return rng() % n;
+}
+
+static double unit(std::mt19937 &rng) {
+  return rng() / 4294967296.0;
+}
+
+/* Arithmetic expressions with + and * at two precedence levels and parentheses. Unambiguous. */
+static void gen_expr_tokens(std::mt19937 &rng, int n, std::vector<std::string> &out) {
+  if (n <= 2) {
+    out.push_back("x");
+  } else if (pick(rng, 4) == 0) {
+    out.push_back("lp");
+    gen_expr_tokens(rng, n - 2, out);
+    out.push_back("rp");
+  } else {
+    int left = 1 + pick(rng, n - 2);
+    gen_expr_tokens(rng, left, out);
+    out.push_back(pick(rng, 2) ? "plus" : "times");
+    gen_expr_tokens(rng, n - 1 - left, out);
+  }
+}
+
+static void gen_expr(Corpus &c, int n, std::mt19937 &rng) {
+  c.rule("E", "E", "A"); c.rule("E", "T", "M"); c.rule("E", "L", "R"); c.token_rule("E", "x");
+  c.rule("T", "T", "M"); c.rule("T", "L", "R"); c.token_rule("T", "x");
+  c.rule("F", "L", "R"); c.token_rule("F", "x");
+  c.rule("A", "PL", "T");
+  c.rule("M", "TI", "F");
+  c.rule("R", "E", "RP");
+  c.token_rule("L", "lp"); c.token_rule("RP", "rp"); c.token_rule("PL", "plus"); c.token_rule("TI", "times");
+  gen_expr_tokens(rng, n, c.tokens);
+}
+
+/* Nested lists of atoms, as in s-expressions. Unambiguous, with deep right-recursive chains. */
+static void gen_list_tokens(std::mt19937 &rng, int n, std::vector<std::string> &out) {
+  if (n <= 1) {
+    out.push_back("a");
+  } else if (n == 2) {
+    out.push_back("lb");
+    out.push_back("rb");
+  } else {
+    out.push_back("lb");
+    for (int left = n - 2; left > 0;) {
+      int item = 1 + pick(rng, std::min(left, 8));
+      gen_list_tokens(rng, item, out);
+      left -= item;
+    }
+    out.push_back("rb");
+  }
+}
+
+static void gen_list(Corpus &c, int n, std::mt19937 &rng) {
+  c.rule("X", "LB", "Z"); c.rule("X", "LB", "RB"); c.token_rule("X", "a");
+  c.rule("Z", "XS", "RB");
+  c.rule("XS", "X", "XS"); c.rule("XS", "LB", "Z"); c.rule("XS", "LB", "RB"); c.token_rule("XS", "a");
+  c.token_rule("LB", "lb"); c.token_rule("RB", "rb");
+  gen_list_tokens(rng, n, c.tokens);
+}
+
+/* E -> E E | a over a^n: every span is derivable in Catalan-many ways. */
+static void gen_ambiguous(Corpus &c, int n, std::mt19937 &) {
+  c.rule("E", "E", "E"); c.token_rule("E", "a");
+  c.tokens.assign(n, "a");
+}
+
+/* Random CNF over opts.nts nonterminals and 4 tokens: each binary rule exists with probability opts.density, and
+   each nonterminal derives each token with probability 1/2. The tokens are uniformly random. */
+static void gen_random(Corpus &c, int n, std::mt19937 &rng, const GenOptions &opts) {
+  const int num_tokens = 4;
+  auto nt = [](int k) { return "N" + std::to_string(k); };
+  auto token = [](int k) { return "t" + std::to_string(k); };
+  for (int a = 0; a < opts.nts; ++a) {
+    for (int b = 0; b < opts.nts; ++b) {
+      for (int d = 0; d < opts.nts; ++d) {
+        if (unit(rng) < opts.density || (a == 0 && b == 0 && d == 0)) {
+          c.rule(nt(a), nt(b), nt(d));
+        }
+      }
+    }
+  }
+  for (int t = 0; t < num_tokens; ++t) {
+    c.token_rule(nt(0), token(t));
+    for (int a = 1; a < opts.nts; ++a) {
+      if (pick(rng, 2)) {
+        c.token_rule(nt(a), token(t));
+      }
+    }
+  }
+  for (int k = 0; k < n; ++k) {
+    c.tokens.push_back(token(pick(rng, num_tokens)));
+  }
+}
+
+static const char *FAMILIES[] = {"expr", "list", "ambiguous", "random"};
+
+static bool generate(const std::string &family, int n, const GenOptions &opts, Corpus &c) {
+  std::mt19937 rng(opts.seed);
+  c.name = family;
+  if (family == "expr") {
+    gen_expr(c, n, rng);
+  } else if (family == "list") {
+    gen_list(c, n, rng);
+  } else if (family == "ambiguous") {
+    gen_ambiguous(c, n, rng);
+  } else if (family == "random") {
+    gen_random(c, n, rng, opts);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Phases
+////////////////////////////////////////////////////////////////////////////////
+
+/** A corpus interned into a SymbolTable: nonterminals first, so that the grammar covers exactly those, then tokens. */
+struct Instance {
+  SymbolTable symbols;
+  int num_nts;
+  int max_productions;
+  std::vector<std::vector<int> > binary;    // {A, B, C}
+  std::map<int, std::vector<int> > derives; // token -> nonterminals that derive it
+  std::vector<int> tokens;
+  std::vector<int> nts;
+  int start;
+
+  Instance(Corpus &c) {
+    for (auto &rule : c.rules) {
+      symbols.intern(rule[0], false);
+      for (size_t k = 1; rule.size() == 3 && k < 3; ++k) {
+        symbols.intern(rule[k], false);
+      }
+    }
+    num_nts = symbols.size();
+    std::map<int, int> productions;
+    for (auto &rule : c.rules) {
+      int l = symbols.lookup(rule[0]);
+      if (rule.size() == 3) {
+        binary.push_back({l, symbols.lookup(rule[1]), symbols.lookup(rule[2])});
+        ++productions[l];
+      } else {
+        derives[symbols.intern(rule[1], true)].push_back(l);
+      }
+    }
+    max_productions = 1;
+    for (auto &p : productions) {
+      max_productions = std::max(max_productions, p.second);
+    }
+    for (auto &t : c.tokens) {
+      tokens.push_back(symbols.intern(t, true));
+    }
+    for (int nt = 1; nt < num_nts; ++nt) {
+      nts.push_back(nt);
+    }
+    start = symbols.lookup(c.rules[0][0]);
+  }
+
+  /* A table over the tokens, with singletons set. The table owns (and deletes) its grammar. */
+  CYK *init() {
+    Grammar *g = new Grammar(num_nts, max_productions);
+    for (auto &rule : binary) {
+      g->add(rule[0], rule[1], rule[2]);
+    }
+    CYK *cyk = new CYK(tokens.size(), *g);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      for (int nt : derives[tokens[i]]) {
+        cyk->set_cyk(nt, i, 1);
+      }
+    }
+    return cyk;
+  }
+};
+
+struct PhaseResult {
+  std::string name;
+  int tokens;
+  std::vector<double> ms;
+  size_t peak;
+  std::vector<double> counters; // of the last run, which every run repeats exactly
+};
+
+struct BenchOptions {
+  int repeat = 3;
+  int span = 0;
+};
+
+/* Time f and record its peak allocation above what was live before it. */
+static void measure(PhaseResult &phase, const std::function<void()> &f) {
+  size_t before = live_bytes;
+  peak_bytes = live_bytes;
+  Stats::reset();
+  auto t = std::chrono::steady_clock::now();
+  f();
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - t;
+  phase.ms.push_back(elapsed.count());
+  phase.peak = std::max(phase.peak, peak_bytes - before);
+  phase.counters.clear();
+  for (int stat = 0; stat < Stats::size(); ++stat) {
+    phase.counters.push_back(Stats::get(stat));
+  }
+}
+
+static std::vector<PhaseResult> bench(Instance &inst, const BenchOptions &opts) {
+  int m = inst.tokens.size();
+  int span = opts.span > 0 ? std::min(opts.span, m) : std::min(m, 24);
+  std::vector<PhaseResult> phases = {
+    {"init", m, {}, 0, {}}, {"parse", m, {}, 0, {}}, {"colorize", m, {}, 0, {}},
+    {"constraint", span, {}, 0, {}}, {"intersect", span, {}, 0, {}}, {"solve", span, {}, 0, {}}};
+  std::vector<int> no_constraints;
+  for (int r = 0; r < opts.repeat; ++r) {
+    CYK *cyk = nullptr;
+    measure(phases[0], [&]() { cyk = inst.init(); });
+    measure(phases[1], [&]() { cyk->parse(); });
+    measure(phases[2], [&]() { cyk->colorize(); });
+    // two samples of the same root over the first span tokens, as when a nonterminal is labeled twice
+    ConstraintState *c1 = nullptr, *c2 = nullptr, c3;
+    measure(phases[3], [&]() {
+      c1 = new ConstraintState(*cyk, inst.tokens, inst.nts, no_constraints, 0, inst.start, 0, span);
+      c2 = new ConstraintState(*cyk, inst.tokens, inst.nts, no_constraints, 1, inst.start, 0, span);
+    });
+    measure(phases[4], [&]() { ConstraintState::intersect(*c1, *c2, c3); });
+    measure(phases[5], [&]() {
+      Solution solution;
+      c3.solve_shortest(solution);
+    });
+    delete c1;
+    delete c2;
+    delete cyk;
+  }
+  return phases;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+static std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static void print_result(std::ostream &out, const std::string &name, Instance &inst,
+    std::vector<PhaseResult> &phases) {
+  out << "{\"corpus\": " << json_string(name)
+      << ", \"tokens\": " << inst.tokens.size()
+      << ", \"nonterminals\": " << inst.num_nts - 1
+      << ", \"rules\": " << inst.binary.size()
+      << ", \"phases\": [";
+  for (size_t k = 0; k < phases.size(); ++k) {
+    PhaseResult &phase = phases[k];
+    std::vector<double> ms = phase.ms;
+    std::sort(ms.begin(), ms.end());
+    double median = ms[ms.size() / 2];
+    out << (k ? ", " : "")
+        << "{\"phase\": " << json_string(phase.name)
+        << ", \"tokens\": " << phase.tokens
+        << ", \"ms\": " << median
+        << ", \"min_ms\": " << ms[0]
+        << ", \"tokens_per_s\": " << (median > 0 ? phase.tokens * 1000.0 / median : 0)
+        << ", \"peak_bytes\": " << phase.peak;
+    if (Stats::enabled()) {
+      out << ", \"counters\": {";
+      bool first = true;
+      for (int stat = 0; stat < Stats::size(); ++stat) {
+        if (phase.counters[stat] != 0) {
+          out << (first ? "" : ", ") << json_string(Stats::name(stat)) << ": " << (long long)phase.counters[stat];
+          first = false;
+        }
+      }
+      out << "}";
+    }
+    out << "}";
+  }
+  out << "]}";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////
+
+static int usage() {
+  std::cerr << "usage: bench gen FAMILY N GRAMMAR_FILE TOKENS_FILE [--seed S] [--density D] [--nts K]\n"
+            << "       bench run GRAMMAR_FILE TOKENS_FILE [--repeat R] [--span L] [--trace FILE]\n"
+            << "       bench suite [--sizes N,N,...] [--repeat R] [--span L] [--seed S] [--density D] [--nts K]"
+            << " [--trace FILE]\n";
+  return 2;
+}
+
+static bool write_trace(const std::string &trace_file) {
+  if (trace_file.empty()) {
+    return true;
+  }
+  if (!Trace::enabled()) {
+    std::cerr << "bench: not built with PARSIMONY_TRACE, no trace written" << std::endl;
+    return false;
+  }
+  std::ofstream trace(trace_file);
+  trace << Trace::export_json() << std::endl;
+  return (bool)trace;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> args;
+  GenOptions gen_opts;
+  BenchOptions bench_opts;
+  std::vector<int> sizes = {64, 128, 256};
+  std::string trace_file;
+  for (int k = 1; k < argc; ++k) {
+    std::string arg = argv[k];
+    if (arg.compare(0, 2, "--") != 0) {
+      args.push_back(arg);
+      continue;
+    }
+    if (k + 1 == argc) {
+      return usage();
+    }
+    std::string value = argv[++k];
+    if (arg == "--seed") {
+      gen_opts.seed = std::stoul(value);
+    } else if (arg == "--density") {
+      gen_opts.density = std::stod(value);
+    } else if (arg == "--nts") {
+      gen_opts.nts = std::max(1, std::stoi(value));
+    } else if (arg == "--repeat") {
+      bench_opts.repeat = std::max(1, std::stoi(value));
+    } else if (arg == "--trace") {
+      trace_file = value;
+    } else if (arg == "--span") {
+      bench_opts.span = std::stoi(value);
+    } else if (arg == "--sizes") {
+      sizes.clear();
+      std::istringstream list(value);
+      std::string size;
+      while (std::getline(list, size, ',')) {
+        sizes.push_back(std::stoi(size));
+      }
+    } else {
+      return usage();
+    }
+  }
+
+  if (args.size() == 5 && args[0] == "gen") {
+    Corpus corpus;
+    if (!generate(args[1], std::stoi(args[2]), gen_opts, corpus)) {
+      std::cerr << "bench: unknown family " << args[1] << std::endl;
+      return 2;
+    }
+    return write_corpus(corpus, args[3], args[4]) ? 0 : 1;
+  }
+
+  if (args.size() == 3 && args[0] == "run") {
+    Corpus corpus;
+    if (!read_corpus(args[1], args[2], corpus)) {
+      std::cerr << "bench: cannot read " << args[1] << " and " << args[2] << std::endl;
+      return 1;
+    }
+    Instance inst(corpus);
+    std::vector<PhaseResult> phases = bench(inst, bench_opts);
+    print_result(std::cout, corpus.name, inst, phases);
+    std::cout << std::endl;
+    return write_trace(trace_file) ? 0 : 1;
+  }
+
+  if (args.size() == 1 && args[0] == "suite") {
+    std::cout << "[";
+    bool first = true;
+    for (const char *family : FAMILIES) {
+      for (int n : sizes) {
+        Corpus corpus;
+        generate(family, n, gen_opts, corpus);
+        Instance inst(corpus);
+        std::vector<PhaseResult> phases = bench(inst, bench_opts);
+        std::cout << (first ? "\n" : ",\n");
+        print_result(std::cout, corpus.name + "-" + std::to_string(n), inst, phases);
+        first = false;
+      }
+    }
+    std::cout << "\n]" << std::endl;
+    return write_trace(trace_file) ? 0 : 1;
+  }
+
+  return usage();
+}
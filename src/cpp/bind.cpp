@@ -1,37 +1,125 @@
 #include <emscripten/bind.h>
+#include <emscripten/val.h>
+#include "cache.h"
+#include "cancel.h"
 #include "inference.h"
+#include "packed.h"
 #include "parser.h"
+#include "stats.h"
+#include "symbols.h"
+#include "trace.h"
 
 using namespace emscripten;
 
+/** Return an Int32Array view of the buffer's contents directly over the Emscripten heap. */
+val packed_buffer_view(PackedBuffer &buffer) {
+  return val(typed_memory_view(buffer.data.size(), buffer.ptr()));
+}
+
 EMSCRIPTEN_BINDINGS(my_module) {
 
   /** parser.h **/
 
   class_<Grammar>("Grammar")
-    .constructor<int, int>()
+    .constructor<SymbolTable&, int>()
     .function("add", &Grammar::add)
+    .function("add_weighted", &Grammar::add_weighted)
+    .function("add_child_filter", &Grammar::add_child_filter)
+    .function("add_filtered", &Grammar::add_filtered)
     .function("print", &Grammar::print)
     ;
 
   class_<CYK>("CYK")
-    .constructor<int, int, Grammar&>()
+    .constructor<int, Grammar&>()
+    .constructor<int, Grammar&, int>()
     .function("set_cyk", &CYK::set_cyk)
     .function("unset_cyk", &CYK::unset_cyk)
     .function("get_cyk", &CYK::get_cyk)
+    .function("get_value", &CYK::get_value)
     .function("get_lmax", &CYK::get_lmax)
+    .function("get_n", &CYK::get_n)
     .function("parse", &CYK::parse)
     .function("parse_partial", &CYK::parse_partial)
+    .function("parse_lazy", &CYK::parse_lazy)
+    .function("set_pruning", &CYK::set_pruning)
+    .function("add_symbols", &CYK::add_symbols)
+    .function("reparse", &CYK::reparse)
+    .function("fork", &CYK::fork, allow_raw_pointers())
+    .function("export_packed", &CYK::export_packed)
+    .function("load_packed", &CYK::load_packed)
     .function("get_colors", &CYK::get_colors)
+    .function("export_colors", &CYK::export_colors)
+    .function("export_symbols", &CYK::export_symbols)
+    .function("export_chart", &CYK::export_chart)
     .function("ignore", &CYK::ignore)
+    .function("set_cancel_token", &CYK::set_cancel_token, allow_raw_pointers())
+    .function("is_cancelled", &CYK::is_cancelled)
     .function("colorize", &CYK::colorize)
     .function("init_colorize_partial", &CYK::init_colorize_partial)
     .function("colorize_partial", &CYK::colorize_partial)
+    .function("recolorize", &CYK::recolorize)
     .function("print_cyk", &CYK::print_cyk)
     .function("print_col", &CYK::print_col)
     .function("print_info", &CYK::print_info)
     ;
 
+  class_<CountingCYK>("CountingCYK")
+    .constructor<int, Grammar&>()
+    .function("set_cyk", &CountingCYK::set_cyk)
+    .function("unset_cyk", &CountingCYK::unset_cyk)
+    .function("get_cyk", &CountingCYK::get_cyk)
+    .function("get_value", &CountingCYK::get_value)
+    .function("get_lmax", &CountingCYK::get_lmax)
+    .function("get_n", &CountingCYK::get_n)
+    .function("parse", &CountingCYK::parse)
+    .function("parse_partial", &CountingCYK::parse_partial)
+    .function("parse_lazy", &CountingCYK::parse_lazy)
+    .function("set_pruning", &CountingCYK::set_pruning)
+    .function("add_symbols", &CountingCYK::add_symbols)
+    .function("reparse", &CountingCYK::reparse)
+    .function("fork", &CountingCYK::fork, allow_raw_pointers())
+    .function("ignore", &CountingCYK::ignore)
+    .function("set_cancel_token", &CountingCYK::set_cancel_token, allow_raw_pointers())
+    .function("is_cancelled", &CountingCYK::is_cancelled)
+    ;
+
+  class_<ScoreCYK>("ScoreCYK")
+    .constructor<int, Grammar&>()
+    .function("set_cyk", &ScoreCYK::set_cyk)
+    .function("unset_cyk", &ScoreCYK::unset_cyk)
+    .function("get_cyk", &ScoreCYK::get_cyk)
+    .function("get_value", &ScoreCYK::get_value)
+    .function("get_lmax", &ScoreCYK::get_lmax)
+    .function("get_n", &ScoreCYK::get_n)
+    .function("parse", &ScoreCYK::parse)
+    .function("parse_partial", &ScoreCYK::parse_partial)
+    .function("parse_lazy", &ScoreCYK::parse_lazy)
+    .function("set_pruning", &ScoreCYK::set_pruning)
+    .function("add_symbols", &ScoreCYK::add_symbols)
+    .function("reparse", &ScoreCYK::reparse)
+    .function("fork", &ScoreCYK::fork, allow_raw_pointers())
+    .function("ignore", &ScoreCYK::ignore)
+    .function("set_cancel_token", &ScoreCYK::set_cancel_token, allow_raw_pointers())
+    .function("is_cancelled", &ScoreCYK::is_cancelled)
+    ;
+
+  class_<SegmentedCYK>("SegmentedCYK")
+    .constructor<int, Grammar&, std::vector<int>&, int>()
+    .function("set_cyk", &SegmentedCYK::set_cyk)
+    .function("get_cyk", &SegmentedCYK::get_cyk)
+    .function("ignore", &SegmentedCYK::ignore)
+    .function("parse", &SegmentedCYK::parse)
+    .function("colorize", &SegmentedCYK::colorize)
+    .function("get_colors", &SegmentedCYK::get_colors)
+    .function("export_colors", &SegmentedCYK::export_colors)
+    .function("get_num_segments", &SegmentedCYK::get_num_segments)
+    .function("is_stitched", &SegmentedCYK::is_stitched)
+    .function("set_cancel_token", &SegmentedCYK::set_cancel_token, allow_raw_pointers())
+    .function("is_cancelled", &SegmentedCYK::is_cancelled)
+    ;
+
+  function("export_ambiguous_spans", &export_ambiguous_spans);
+
   class_<ColorSet>("ColorSet")
     .constructor<>()
     .function("nt", &ColorSet::nt)
@@ -40,6 +128,74 @@ EMSCRIPTEN_BINDINGS(my_module) {
     .function("size", &ColorSet::size)
     ;
 
+  /** symbols.h **/
+
+  class_<SymbolTable>("SymbolTable")
+    .constructor<>()
+    .function("intern_all", &SymbolTable::intern_all)
+    .function("lookup", &SymbolTable::lookup)
+    .function("is_terminal", &SymbolTable::is_terminal)
+    .function("get_name", &SymbolTable::get_name)
+    .function("names_from", &SymbolTable::names_from)
+    .function("size", &SymbolTable::size)
+    ;
+
+  /** cache.h **/
+
+  class_<ParseCache>("ParseCache")
+    .constructor<int>()
+    .function("restore", &ParseCache::restore)
+    .function("store", &ParseCache::store)
+    .function("reserve", &ParseCache::reserve)
+    .function("clear", &ParseCache::clear)
+    .function("num_entries", &ParseCache::num_entries)
+    .function("num_bytes", &ParseCache::num_bytes)
+    .function("get_hits", &ParseCache::get_hits)
+    .function("get_misses", &ParseCache::get_misses)
+    .function("export_packed", &ParseCache::export_packed)
+    .function("load_packed", &ParseCache::load_packed)
+    ;
+
+  /** cancel.h **/
+
+  class_<CancelToken>("CancelToken")
+    .constructor<>()
+    .function("cancel", &CancelToken::cancel)
+    .function("reset", &CancelToken::reset)
+    .function("cancelled", &CancelToken::cancelled)
+    ;
+
+  /** stats.h **/
+
+  class_<Stats>("Stats")
+    .class_function("enabled", &Stats::enabled)
+    .class_function("reset", &Stats::reset)
+    .class_function("size", &Stats::size)
+    .class_function("name", &Stats::name)
+    .class_function("get", &Stats::get)
+    ;
+
+  /** trace.h **/
+
+  class_<Trace>("Trace")
+    .class_function("enabled", &Trace::enabled)
+    .class_function("clear", &Trace::clear)
+    .class_function("size", &Trace::size)
+    .class_function("export_json", &Trace::export_json)
+    ;
+
+  /** packed.h **/
+
+  class_<PackedBuffer>("PackedBuffer")
+    .constructor<>()
+    .function("clear", &PackedBuffer::clear)
+    .function("resize", &PackedBuffer::resize)
+    .function("size", &PackedBuffer::size)
+    .function("get", &PackedBuffer::get)
+    .function("push", &PackedBuffer::push)
+    .function("view", &packed_buffer_view)
+    ;
+
   /** inference.h **/
 
   class_<VertexInfo>("VertexInfo")
@@ -52,26 +208,68 @@ EMSCRIPTEN_BINDINGS(my_module) {
     .function("get_raws", &Solution::get_raws)
     .function("get_paths", &Solution::get_paths)
     .function("get_compressed_path", &Solution::get_compressed_path)
+    .function("get_num_paths", &Solution::get_num_paths)
+    .function("export_packed", &Solution::export_packed)
     .function("print", &Solution::print)
     ;
 
   class_<ConstraintState>("ConstraintState")
     .constructor<>()
+    .constructor<CYK&, std::vector<int>&, std::vector<int>&, std::vector<int>&, int, int, int, int>()
     .function("add_provenance", &ConstraintState::add_provenance)
     .function("add_edge", &ConstraintState::add_edge)
     .function("add_edge_sym", &ConstraintState::add_edge_sym)
     .function("mark_as_terminal", &ConstraintState::mark_as_terminal)
+    .function("mark_terminals", &ConstraintState::mark_terminals)
+    .function("set_cancel_token", &ConstraintState::set_cancel_token, allow_raw_pointers())
+    .function("is_cancelled", &ConstraintState::is_cancelled)
     .function("solve_shortest", &ConstraintState::solve_shortest)
+    .function("solve_shortest_k", &ConstraintState::solve_shortest_k)
     .function("solve_shortest_non_unit", &ConstraintState::solve_shortest_non_unit)
+    .function("solve_shortest_non_unit_k", &ConstraintState::solve_shortest_non_unit_k)
+    .function("solve_shortest_and_non_unit", &ConstraintState::solve_shortest_and_non_unit)
     .function("empty", &ConstraintState::empty)
+    .function("has_solution", &ConstraintState::has_solution)
+    .function("compact", &ConstraintState::compact)
     .function("num_provenance_elements", &ConstraintState::num_provenance_elements)
     .function("get_provenance_sample_id", &ConstraintState::get_provenance_sample_id)
     .function("get_provenance_nt", &ConstraintState::get_provenance_nt)
     .function("get_provenance_i", &ConstraintState::get_provenance_i)
     .function("get_provenance_l", &ConstraintState::get_provenance_l)
     .function("get_edges", &ConstraintState::get_edges)
+    .function("export_packed", &ConstraintState::export_packed)
+    .function("load_packed", &ConstraintState::load_packed)
     .function("print", &ConstraintState::print)
-    .class_function("intersect", &ConstraintState::intersect);
+    .class_function("intersect", &ConstraintState::intersect)
+    .class_function("compatibility", &ConstraintState::compatibility)
+    ;
+
+  class_<PartitionScorer>("PartitionScorer")
+    .constructor<>()
+    .function("add", &PartitionScorer::add)
+    .function("score", &PartitionScorer::score)
+    .function("num_candidates", &PartitionScorer::num_candidates)
+    .function("get_candidate_i", &PartitionScorer::get_candidate_i)
+    .function("get_candidate_j", &PartitionScorer::get_candidate_j)
+    .function("get_score", &PartitionScorer::get_score)
+    .function("get_max_score", &PartitionScorer::get_max_score)
+    ;
+
+  class_<QuerySession>("QuerySession")
+    .constructor<>()
+    .function("set_constraint", &QuerySession::set_constraint)
+    .function("add_query", &QuerySession::add_query)
+    .function("num_queries", &QuerySession::num_queries)
+    .function("clear_queries", &QuerySession::clear_queries)
+    .function("run", &QuerySession::run)
+    ;
+
+  class_<SolveBatch>("SolveBatch")
+    .constructor<>()
+    .function("add", &SolveBatch::add)
+    .function("size", &SolveBatch::size)
+    .function("solve", &SolveBatch::solve)
+    .function("export_packed", &SolveBatch::export_packed)
     ;
 
   register_vector<int>("VInt");
@@ -0,0 +1,165 @@
+#include "cache.h"
+#include "debug.h"
+#include <iterator>
+
+////////////////////////////////////////////////////////////////////////////////
+// ParseCache
+////////////////////////////////////////////////////////////////////////////////
+
+static const int CACHE_VERSION = 2;
+
+ParseCache::ParseCache(int budget): budget(budget), used(0), hits(0), misses(0) {}
+
+/* The key of cyk, with the content it hashes (that of the grammar, then that of the table) appended to content. */
+ParseCache::Key ParseCache::key(CYK &cyk, std::vector<int> &content) {
+  uint64_t grammar = cyk.grammar.fingerprint(&content);
+  return Key(grammar, cyk.fingerprint(&content));
+}
+
+size_t ParseCache::bytes(const std::vector<int> &content, const std::vector<int> &data) {
+  return (content.size() + data.size()) * sizeof(int);
+}
+
+/* Add an entry as the most recently used one, replacing any entry with the same key and evicting the least recently
+   used ones as needed. Entries larger than the whole budget are not kept. Takes the contents of content and data. */
+void ParseCache::insert(Key key, bool colors, std::vector<int> &content, std::vector<int> &data) {
+  auto found = index.find(key);
+  if (found != index.end()) {
+    remove(found->second);
+  }
+  size_t size = bytes(content, data);
+  if (size > budget) {
+    return;
+  }
+  while (used + size > budget) {
+    remove(std::prev(entries.end()));
+  }
+  entries.push_front(Entry{key, colors, std::vector<int>(), std::vector<int>()});
+  entries.front().content.swap(content);
+  entries.front().data.swap(data);
+  index[key] = entries.begin();
+  used += size;
+}
+
+void ParseCache::remove(std::list<Entry>::iterator it) {
+  used -= bytes(it->content, it->data);
+  index.erase(it->key);
+  entries.erase(it);
+}
+
+/* If a parse of a table with the same content as cyk (which must not be parsed yet) is cached, load it into cyk and
+   return true. With colors, only a snapshot that includes the coloring will do. */
+bool ParseCache::restore(CYK &cyk, bool colors) {
+  std::vector<int> content;
+  auto found = index.find(key(cyk, content));
+  if (found == index.end() || (colors && !found->second->colors) || found->second->content != content) {
+    ++misses;
+    return false;
+  }
+  entries.splice(entries.begin(), entries, found->second);
+  PackedBuffer snapshot;
+  snapshot.data.swap(entries.front().data);
+  bool ok = cyk.load_packed(snapshot);
+  snapshot.data.swap(entries.front().data);
+  if (!ok) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  return true;
+}
+
+/* Cache cyk, which must be parsed (and colorized, with colors). A cached snapshot with the coloring is not replaced by
+   one without. Returns false if cyk cannot be snapshotted (see BasicCYK::export_packed). */
+bool ParseCache::store(CYK &cyk, bool colors) {
+  std::vector<int> content;
+  Key k = key(cyk, content);
+  auto found = index.find(k);
+  if (found != index.end() && found->second->colors && !colors && found->second->content == content) {
+    entries.splice(entries.begin(), entries, found->second);
+    return true;
+  }
+  PackedBuffer snapshot;
+  if (!cyk.export_packed(snapshot, colors)) {
+    return false;
+  }
+  DEBUG_PRINT(("ParseCache::store: %d ints\n", snapshot.size()));
+  insert(k, colors, content, snapshot.data);
+  return true;
+}
+
+/* Evict the least recently used entries until a table of the given bytes fits in the budget along with the rest, so that
+   the cache gives way to tables that are too large to share the heap with it. */
+void ParseCache::reserve(int bytes) {
+  while (!entries.empty() && used + bytes > budget) {
+    remove(std::prev(entries.end()));
+  }
+}
+
+void ParseCache::clear() {
+  entries.clear();
+  index.clear();
+  used = 0;
+}
+
+int ParseCache::num_entries() {
+  return entries.size();
+}
+
+int ParseCache::num_bytes() {
+  return used;
+}
+
+int ParseCache::get_hits() {
+  return hits;
+}
+
+int ParseCache::get_misses() {
+  return misses;
+}
+
+/* Export every entry into out, replacing its contents:
+
+     header   VERSION E
+     entries  E times: grammar_lo grammar_hi table_lo table_hi colors c size, then c ints of content and size ints of
+              snapshot
+
+   Entries are written least recently used first, so that load_packed restores their order. */
+void ParseCache::export_packed(PackedBuffer &out) {
+  out.clear();
+  out.push(CACHE_VERSION);
+  out.push(entries.size());
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    out.push(it->key.first & 0xffffffff);
+    out.push(it->key.first >> 32);
+    out.push(it->key.second & 0xffffffff);
+    out.push(it->key.second >> 32);
+    out.push(it->colors);
+    out.push(it->content.size());
+    out.push(it->data.size());
+    out.append(it->content);
+    out.append(it->data);
+  }
+}
+
+/* Add the entries exported by export_packed, as the most recently used ones. A buffer from another version, or a
+   truncated one, is ignored from the first entry that does not fit. */
+void ParseCache::load_packed(PackedBuffer &in) {
+  const int *p = in.ptr();
+  const int *end = p + in.size();
+  if (end - p < 2 || p[0] != CACHE_VERSION) {
+    return;
+  }
+  int num = p[1];
+  p += 2;
+  for (int e = 0; e < num; ++e) {
+    if (end - p < 7 || p[5] < 0 || p[6] < 0 || end - p - 7 < p[5] || end - p - 7 - p[5] < p[6]) {
+      return;
+    }
+    Key k(((uint64_t)(uint32_t)p[1] << 32) | (uint32_t)p[0], ((uint64_t)(uint32_t)p[3] << 32) | (uint32_t)p[2]);
+    std::vector<int> content(p + 7, p + 7 + p[5]);
+    std::vector<int> data(p + 7 + p[5], p + 7 + p[5] + p[6]);
+    insert(k, p[4] != 0, content, data);
+    p += 7 + p[5] + p[6];
+  }
+}
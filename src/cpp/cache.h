@@ -0,0 +1,60 @@
+#ifndef _cache_h
+#define _cache_h
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+#include "packed.h"
+#include "parser.h"
+
+/** A content-addressed cache of parsed CYK tables. Entries are keyed by the fingerprint of the grammar and that of the
+    table before parsing (its tokens, pins and ignored symbols, see BasicCYK::fingerprint), so an entry can be reused
+    by any table with the same content, regardless of which editor or sample it came from. Each entry holds a snapshot
+    in the format of BasicCYK::export_packed, along with the content that was hashed, which is compared on every hit
+    so that a collision of fingerprints is a miss rather than a wrong table.
+
+    The least recently used entries are evicted to keep the entries within a budget of bytes, and to make room for a
+    table about to be allocated (see reserve), since both share the heap. The whole cache can be exported to, and
+    loaded from, a PackedBuffer, so that JS can persist it across sessions. */
+class ParseCache {
+
+  typedef std::pair<uint64_t, uint64_t> Key; // (grammar fingerprint, table fingerprint)
+
+  struct Entry {
+    Key key;
+    bool colors;              // whether the snapshot includes the coloring
+    std::vector<int> content; // the grammar and table content hashed into key
+    std::vector<int> data;    // the snapshot
+  };
+
+  std::list<Entry> entries; // most recently used first
+  std::map<Key, std::list<Entry>::iterator> index;
+  size_t budget;            // bytes of entries to keep at most
+  size_t used;              // bytes of entries kept
+  int hits;
+  int misses;
+
+  static Key key(CYK &cyk, std::vector<int> &content);
+  static size_t bytes(const std::vector<int> &content, const std::vector<int> &data);
+  void insert(Key key, bool colors, std::vector<int> &content, std::vector<int> &data);
+  void remove(std::list<Entry>::iterator it);
+
+public:
+
+  ParseCache(int budget);
+
+  bool restore(CYK &cyk, bool colors); // load a cached parse of cyk instead of parsing it
+  bool store(CYK &cyk, bool colors);   // cache a parsed cyk
+  void reserve(int bytes);             // evict entries to make room for a table about to be allocated
+  void clear();
+  int num_entries();
+  int num_bytes();
+  int get_hits();
+  int get_misses();
+  void export_packed(PackedBuffer &out);
+  void load_packed(PackedBuffer &in);
+};
+
+#endif
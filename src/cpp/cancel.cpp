@@ -0,0 +1,19 @@
+#include "cancel.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CancelToken
+////////////////////////////////////////////////////////////////////////////////
+
+CancelToken::CancelToken(): flag(0) {}
+
+void CancelToken::cancel() {
+  flag.store(1, std::memory_order_relaxed);
+}
+
+void CancelToken::reset() {
+  flag.store(0, std::memory_order_relaxed);
+}
+
+bool CancelToken::cancelled() {
+  return flag.load(std::memory_order_relaxed) != 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _cancel_h
+#define _cancel_h
+
+#include <atomic>
+
+/** A flag asking long-running engine calls to stop early. Calls given a token poll it at diagonal (parse, colorize) or
+    iteration (intersection, path enumeration) boundaries, and once it is set, return promptly and report that they were
+    cancelled; see BasicCYK::is_cancelled and ConstraintState::is_cancelled. The flag stays set until reset.
+
+    The flag is atomic, so another thread may cancel a running call (PARSIMONY_THREADS). In the single-threaded build a
+    token can only be set between calls, which makes the next call return at its first poll. */
+class CancelToken {
+
+  std::atomic<int> flag;
+
+public:
+
+  CancelToken();
+
+  void cancel();
+  void reset();
+  bool cancelled();
+};
+
+#endif
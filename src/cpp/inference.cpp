@@ -1,5 +1,8 @@
 #include "inference.h"
 #include "debug.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
 #include <algorithm>
 #include <tuple>
 #include <boost/graph/lookup_edge.hpp>
@@ -116,26 +119,116 @@ std::ostream & operator<<(std::ostream &stream, const Provenance &provenance) {
 // ConstraintState
 ////////////////////////////////////////////////////////////////////////////////
 
-ConstraintState::ConstraintState() {}
+ConstraintState::ConstraintState() : reachability_valid(false), cancel_token(nullptr), cancelled(false) {}
+
+/* Build the constraint state for the positive constraint root (nt, j, k) of one sample directly from a filled CYK table,
+   without going through a ClojureScript constraint state. This mirrors inference/gen-one-constraint-state exactly.
+
+   token_syms[i] is the encoded terminal of token i, nts are the encoded candidate nonterminals (multinode nonterminals
+   already removed), and constraints holds all positive constraints of the sample as flattened (nt, i, l) triples.
+   Symbols outside of the CYK table never match. */
+ConstraintState::ConstraintState(CYK &cyk, std::vector<sym_t> &token_syms, std::vector<sym_t> &nts,
+    std::vector<int> &constraints, int sample_id, sym_t nt, pos_t j, int k) :
+    reachability_valid(false), cancel_token(nullptr), cancelled(false) {
+  TRACE_SCOPE("constraint-init");
+  add_provenance(sample_id, nt, j, k);
+  for (auto sym : token_syms) {
+    mark_as_terminal(sym);
+  }
+
+  // extents mentioned by a constraint other than the root, with the nonterminals constrained at each
+  std::map<std::pair<pos_t, int>, std::vector<sym_t>> constrained;
+  for (size_t c = 0; c + 2 < constraints.size(); c += 3) {
+    if (constraints[c+1] != j || constraints[c+2] != k) {
+      constrained[std::make_pair(constraints[c+1], constraints[c+2])].push_back(constraints[c]);
+    }
+  }
+
+  int n = cyk.get_n();
+  auto matches = [&cyk, n](sym_t sym, pos_t i, int l) { return sym > 0 && sym < n && cyk.get_cyk(sym, i, l); };
+
+  for (pos_t i = j; i < j + k; ++i) {
+    for (int l = k - (i - j); l >= 1; --l) {
+      std::vector<sym_t> syms;
+      auto found = constrained.find(std::make_pair(i, l));
+      if (found != constrained.end()) {
+        // add every nonterminal at a constrained extent (unit rules may apply), and skip the sub-extents starting at i
+        for (auto sym : nts) {
+          if (matches(sym, i, l)) {
+            syms.push_back(sym);
+          }
+        }
+        syms.insert(syms.end(), found->second.begin(), found->second.end());
+        add_extent_edge(i, l, syms);
+        break;
+      }
+
+      if (l == 1) {
+        syms.push_back(token_syms[i]);
+      }
+      for (auto sym : nts) {
+        // exclude the root itself, since we don't want trivial solutions of the form E = E
+        if (!(sym == nt && i == j && l == k) && matches(sym, i, l)) {
+          syms.push_back(sym);
+        }
+      }
+      add_extent_edge(i, l, syms);
+    }
+  }
+}
+
+void ConstraintState::set_cancel_token(CancelToken *token) {
+  cancel_token = token;
+}
+
+bool ConstraintState::is_cancelled() {
+  return cancelled;
+}
+
+bool ConstraintState::poll_cancel() {
+  if (cancel_token && cancel_token->cancelled()) {
+    cancelled = true;
+  }
+  return cancelled;
+}
+
+/* Remove every vertex, edge, provenance element and terminal, keeping the cancel token. */
+void ConstraintState::clear() {
+  provenance.elems.clear();
+  table.clear();
+  vertex_map.clear();
+  terminal_set.clear();
+  invalidate_reachability();
+}
 
 void ConstraintState::add_provenance(int sample_id, sym_t nt, pos_t i, int l) {
   DEBUG_PRINT(("add_provenance : sample_id=%d nt=%d i=%d l=%d\n", sample_id, nt, i, l));
   provenance.add_provenance(sample_id, nt, i, l);
+  invalidate_reachability();
 };
 
 bool ConstraintState::has_vertex(VertexInfo &vi) {
   return vertex_map.find(vi) != vertex_map.end();
 }
 
-bool ConstraintState::has_vertex_descriptor(vertex_t u, Graph &g) {
-  Graph::vertex_iterator it, end;
-  std::tie(it, end) = boost::vertices(g);
-  for (; it != end; ++it) {
-    if (*it == u) {
-      return true;
+/* Return reachability information for the current graph, recomputing it only if the graph changed since it was last
+   computed. */
+Reachability & ConstraintState::get_reachability() {
+  if (!reachability_valid) {
+    VertexInfo from = start_node();
+    VertexInfo to = end_node();
+    if (has_vertex(from) && has_vertex(to)) {
+      reachability.compute(table, vertex_map[from], vertex_map[to]);
+    } else {
+      reachability.clear(boost::num_vertices(table));
     }
+    reachability_valid = true;
   }
-  return false;
+  return reachability;
+}
+
+void ConstraintState::invalidate_reachability() {
+  reachability_valid = false;
 }
 
 vertex_t ConstraintState::_add_vertex(VertexInfo &vi) {
@@ -146,6 +239,7 @@ vertex_t ConstraintState::_add_vertex(VertexInfo &vi) {
   }
 
   vertex_t v = boost::add_vertex(table);
+  invalidate_reachability();
   vertex_map[vi] = v;
   table[v].positions = vi.positions;
   return v;
@@ -158,6 +252,7 @@ edge_t ConstraintState::_add_edge(VertexInfo &from, VertexInfo &to) {
   edge_t e;
   bool _;
   std::tie(e,_) = boost::add_edge(u, v, table);
+  invalidate_reachability();
   return e;
 }
 
@@ -174,17 +269,45 @@ void ConstraintState::add_edge_sym(VertexInfo &from, VertexInfo &to, sym_t sym)
     edge_t e;
     bool _;
     std::tie(e, _) = boost::add_edge(u, v, table);
+    invalidate_reachability();
     table[e].add_sym(sym);
     // syms must be in sorted order for set intersection to work
     std::sort(table[e].syms.begin(), table[e].syms.end());
   }
 }
 
+/* Add an edge [i] -> [i+l] labeled with syms, unless syms is empty. */
+void ConstraintState::add_extent_edge(pos_t i, int l, std::vector<sym_t> &syms) {
+  if (syms.empty()) {
+    return;
+  }
+
+  VertexInfo from, to;
+  from.add_position(i);
+  to.add_position(i + l);
+  edge_t e = _add_edge(from, to);
+
+  // syms must be in sorted order for set intersection to work
+  std::vector<sym_t> &edge_syms = table[e].syms;
+  edge_syms.insert(edge_syms.end(), syms.begin(), syms.end());
+  std::sort(edge_syms.begin(), edge_syms.end());
+  edge_syms.erase(std::unique(edge_syms.begin(), edge_syms.end()), edge_syms.end());
+}
+
 void ConstraintState::mark_as_terminal(sym_t sym) {
   dout << "mark_as_terminal " << sym << std::endl;
   terminal_set.insert(sym);
 }
 
+/* Mark every terminal in symbols, which is equivalent to calling mark_as_terminal on each of their ids. */
+void ConstraintState::mark_terminals(SymbolTable &symbols) {
+  for (int id = 1; id < symbols.size(); ++id) {
+    if (symbols.is_terminal(id)) {
+      terminal_set.insert(id);
+    }
+  }
+}
+
 VertexInfo ConstraintState::start_node() {
   VertexInfo vi;
   for (auto elem : provenance.elems) {
@@ -257,9 +380,13 @@ std::ostream & operator<<(std::ostream &stream, const ConstraintState &constrain
 // Intersect
 //------------------------------------------------------------------------------
 
-void ConstraintState::init_node_pairs(ConstraintState &c1, ConstraintState &c2, std::set<vertex_pair_t> &node_pairs) {
+void ConstraintState::init_node_pairs(ConstraintState &c1, ConstraintState &c2, std::set<vertex_pair_t> &node_pairs,
+    const Reachability *live1) {
   for (auto r1 = c1.root_begin(); r1 != c1.root_end(); ++r1) {
     vertex_t u = *r1;
+    if (live1 && !live1->on_path(u)) {
+      continue;
+    }
     for (auto r2 = c2.root_begin(); r2 != c2.root_end(); ++r2) {
       vertex_t v = *r2;
       node_pairs.insert(std::make_pair(u, v));
@@ -276,7 +403,11 @@ void ConstraintState::print_node_pairs(ConstraintState &c1, ConstraintState &c2,
   }
 }
 
-bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest, std::set<vertex_pair_t> &node_pairs) {
+/* Expand the next pending pair of the product. Each pair is expanded at most once (see visited), so every product edge
+   is built from exactly one pair of edges and gets each of its syms once. If live1 is given, successors that are not on
+   a start-to-end path of c1 are skipped, since no solution path of the product can pass through them. */
+bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest,
+    std::set<vertex_pair_t> &node_pairs, std::set<vertex_pair_t> &visited, const Reachability *live1) {
   dout << "intersect_iterate" << std::endl;
 
   if (node_pairs.empty()) {
@@ -284,10 +415,12 @@ bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2
     return false;
   }
 
+  TRACE_SCOPE("intersect-iterate");
   auto it = node_pairs.begin();
   vertex_t u, v;
   std::tie(u, v) = *it;
   node_pairs.erase(it);
+  STAT_INC(INTERSECT_PAIRS);
   dout << "current pair = " << c1.table[u] << " " << c2.table[v] << std::endl;
 
   Graph::out_edge_iterator u_out_it, u_out_end, v_out_it, v_out_end;
@@ -296,6 +429,9 @@ bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2
     edge_t e1 = *u_out_it;
     std::vector<sym_t> &e1_syms = c1.table[e1].syms;
     vertex_t usucc = boost::target(e1, c1.table);
+    if (live1 && !live1->on_path(usucc)) {
+      continue;
+    }
 
     for (std::tie(v_out_it, v_out_end) = boost::out_edges(v, c2.table); v_out_it != v_out_end; ++v_out_it) {
       edge_t e2 = *v_out_it;
@@ -338,6 +474,7 @@ bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2
       }
 
       edge_t e3 = dest._add_edge(from, to);
+      STAT_INC(INTERSECT_EDGES);
       EdgeInfo &ei = dest.table[e3];
       for (auto sym : sym_intersection) {
         ei.add_sym(sym);
@@ -348,7 +485,10 @@ bool ConstraintState::intersect_iterate(ConstraintState &c1, ConstraintState &c2
         to   << " " <<
         ei << std::endl;
 
-      node_pairs.insert(std::make_pair(usucc, vsucc));
+      vertex_pair_t succ = std::make_pair(usucc, vsucc);
+      if (visited.insert(succ).second) {
+        node_pairs.insert(succ);
+      }
     }
   }
 
@@ -373,21 +513,39 @@ void ConstraintState::intersect_terminal_set(ConstraintState &c1, ConstraintStat
   }
 }
 
-void ConstraintState::intersect(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest) {
+/* Build the product of c1 and c2 into dest, without pruning vertices that are not on a solution path. If live1 is
+   given, it must be the reachability of c1 and is used to avoid expanding pairs that cannot lead to a solution. */
+void ConstraintState::intersect_product(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest,
+    const Reachability *live1) {
   dout << "intersect : " << std::endl;
   dout << "  constraint 1 : " << std::endl << c1 << std::endl;
   dout << "  constraint 2 : " << std::endl << c2 << std::endl;
 
   std::set<vertex_pair_t> node_pairs;
-  init_node_pairs(c1, c2, node_pairs);
+  init_node_pairs(c1, c2, node_pairs, live1);
+  std::set<vertex_pair_t> visited(node_pairs);
 
   print_node_pairs(c1, c2, node_pairs);
-  while(intersect_iterate(c1, c2, dest, node_pairs)) {
+  while(!dest.poll_cancel() && intersect_iterate(c1, c2, dest, node_pairs, visited, live1)) {
     print_node_pairs(c1, c2, node_pairs);
   }
+  if (dest.cancelled) {
+    dest.clear();
+    return;
+  }
 
   intersect_provenance(c1, c2, dest);
   intersect_terminal_set(c1, c2, dest);
+}
+
+/* If dest has a cancel token, it is polled before each iteration. A cancelled intersection leaves dest empty. */
+void ConstraintState::intersect(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest) {
+  TRACE_SCOPE("intersect");
+  dest.cancelled = false;
+  intersect_product(c1, c2, dest);
+  if (dest.cancelled) {
+    return;
+  }
 
   dout << "pre-remove =" << std::endl;
   dout << dest;
@@ -398,60 +556,30 @@ void ConstraintState::intersect(ConstraintState &c1, ConstraintState &c2, Constr
   dout << dest;
 }
 
-void ConstraintState::compute_all_path_nodes(std::set<vertex_t> &path_nodes) {
-  dout << "compute_all_path_nodes" << std::endl;
-
-  VertexInfo from = start_node();
-  VertexInfo to = end_node();
-
-  if (!has_vertex(from) || !has_vertex(to)) {
-    dout << "either source or target does not exist" << std::endl;
-    return;
+/* Three-valued compatibility check used by partition learning: -1 if the two provenances do not have the same set of LHS
+   nonterminals, 0 if they do but the intersection is empty, and 1 otherwise. These correspond to the nil, false and true
+   results of asm.inference/compatible?. */
+int ConstraintState::compatibility(ConstraintState &c1, ConstraintState &c2) {
+  std::set<sym_t> lhs1, lhs2;
+  for (auto &elem : c1.provenance.elems) {
+    lhs1.insert(elem.nt);
   }
-
-  vertex_t u = vertex_map[from];
-  vertex_t v = vertex_map[to];
-
-  Graph preds;
-  std::set<vertex_t> active;
-  dout << "preds begin" << std::endl;
-  dout << "vertices = " << boost::num_vertices(preds) << std::endl;
-  dout << "edges    = " << boost::num_edges(preds) << std::endl;
-
-  BFSPredGraphVisitor visitor(preds, active);
-  breadth_first_search(table, u, boost::visitor(visitor));
-
-  dout << "preds end" << std::endl;
-  dout << "vertices = " << boost::num_vertices(preds) << std::endl;
-  dout << "edges    = " << boost::num_edges(preds) << std::endl;
-
-  if (!has_vertex_descriptor(v, preds)) {
-    dout << "preds does not reach v" << std::endl;
-    return;
+  for (auto &elem : c2.provenance.elems) {
+    lhs2.insert(elem.nt);
   }
-
-  Graph preds2;
-  std::set<vertex_t> active2;
-  dout << "preds2 begin" << std::endl;
-  dout << "vertices = " << boost::num_vertices(preds2) << std::endl;
-  dout << "edges    = " << boost::num_edges(preds2) << std::endl;
-
-  BFSPredGraphVisitor visitor2(preds2, active2);
-  breadth_first_search(preds, v, boost::visitor(visitor2));
-
-  dout << "preds2 end" << std::endl;
-  dout << "vertices = " << boost::num_vertices(preds2) << std::endl;
-  dout << "edges    = " << boost::num_edges(preds2) << std::endl;
-
-  Graph::vertex_iterator it, end;
-  std::tie(it, end) = boost::vertices(preds2);
-  for (auto v : active2) {
-    path_nodes.insert(v);
+  if (lhs1 != lhs2) {
+    return -1;
   }
+
+  // pruning would leave the intersection empty iff its end node is unreachable, so skip the pruning altogether
+  ConstraintState ci;
+  intersect_product(c1, c2, ci);
+  return ci.has_solution() ? 1 : 0;
 }
 
 void ConstraintState::remove_unit_paths() {
   dout << "remove_unit_paths" << std::endl;
+  TRACE_SCOPE("remove-unit-paths");
 
   VertexInfo from = start_node();
   VertexInfo to = end_node();
@@ -465,229 +593,336 @@ void ConstraintState::remove_unit_paths() {
   vertex_t v = vertex_map[to];
 
   edge_t e;
-  bool found;
-  std::tie(e, found) = boost::lookup_edge(u, v, table);
-
-  if (found) {
-    std::vector<sym_t> syms(table[e].syms.begin(), table[e].syms.end());
-
-    auto terminal_set = this->terminal_set;
-    auto is_nonterminal = [terminal_set](sym_t sym){ return terminal_set.find(sym) == terminal_set.end(); };
-    syms.erase(std::remove_if(syms.begin(), syms.end(), is_nonterminal), syms.end());
-
-    if (syms.size() == 0) {
-      dout << "unit edge found, removing " << from << " " << to << std::endl;
-      boost::remove_edge(e, table);
-      if (0 == boost::degree(u, table)) {
-        dout << "removing start node " << table[u] << std::endl;
-        vertex_map.erase(vertex_map.find(table[u]));
-        boost::clear_vertex(u, table);
-      }
-      if (0 == boost::degree(v, table)) {
-        dout << "removing end node " << table[v] << std::endl;
-        vertex_map.erase(vertex_map.find(table[v]));
-        boost::clear_vertex(v, table);
-      }
+  if (find_unit_edge(u, v, e)) {
+    dout << "unit edge found, removing " << from << " " << to << std::endl;
+    boost::remove_edge(e, table);
+    invalidate_reachability();
+    if (0 == boost::degree(u, table)) {
+      dout << "removing start node " << table[u] << std::endl;
+      vertex_map.erase(vertex_map.find(table[u]));
+      boost::clear_vertex(u, table);
     }
+    if (0 == boost::degree(v, table)) {
+      dout << "removing end node " << table[v] << std::endl;
+      vertex_map.erase(vertex_map.find(table[v]));
+      boost::clear_vertex(v, table);
+    }
+    compact();
   }
 }
 
+/* Remove every vertex that does not lie on a path from the start node to the end node. */
 void ConstraintState::remove_non_solution_nodes() {
   dout << "remove_non_solution_nodes" << std::endl;
-  std::set<vertex_t> path_nodes;
-  compute_all_path_nodes(path_nodes);
-
-  dout << "path nodes = " << std::endl;
-  for (auto vertex : path_nodes) {
-    dout << "  " << vertex << " " << table[vertex] << std::endl;
-  }
+  TRACE_SCOPE("prune");
+  STAT_ADD(PRUNE_VERTICES_BEFORE, boost::num_vertices(table));
+  STAT_ADD(PRUNE_EDGES_BEFORE, boost::num_edges(table));
+  Reachability &reach = get_reachability();
 
-  dout << "graph nodes = " << std::endl;
-  std::set<vertex_t> non_path_nodes;
   Graph::vertex_iterator it, end;
-  std::tie(it, end) = boost::vertices(table);
-  for (; it != end; ++it) {
+  for (std::tie(it, end) = boost::vertices(table); it != end; ++it) {
     vertex_t v = *it;
-    dout << "  " << v << " " << table[v] << std::endl;
-    if (path_nodes.find(v) == path_nodes.end()) {
-      non_path_nodes.insert(v);
+    if (reach.on_path(v)) {
+      continue;
+    }
+    dout << "  non-path-node " << v << " " << table[v] << std::endl;
+    auto found = vertex_map.find(table[v]);
+    if (found != vertex_map.end() && found->second == v) {
+      vertex_map.erase(found);
     }
-  }
-
-  dout << "non-path-nodes = " << std::endl;
-  for (auto v : non_path_nodes) {
-    dout << table[v] << std::endl;
-    vertex_map.erase(vertex_map.find(table[v]));
     boost::clear_vertex(v, table);
   }
+
+  // only edges between non-path vertices were removed, so path vertices are exactly as reachable as before
+  reach.forward &= reach.backward;
+  reach.backward = reach.forward;
+
+  compact();
+  STAT_ADD(PRUNE_VERTICES_AFTER, boost::num_vertices(table));
+  STAT_ADD(PRUNE_EDGES_AFTER, boost::num_edges(table));
 }
 
-//------------------------------------------------------------------------------
-// Shortest Paths
-//------------------------------------------------------------------------------
+/* boost::clear_vertex leaves dead vertices behind in the vecS vertex storage, where every later vertex iteration (root
+   search, intersection, solving) still has to skip over them. Rebuild the graph with only the vertices that are still
+   in vertex_map, renumbered densely in their original order, and remap vertex_map and the reachability bitsets to
+   match. */
+void ConstraintState::compact() {
+  size_t n = boost::num_vertices(table);
+  std::vector<bool> live(n, false);
+  for (auto &entry : vertex_map) {
+    live[entry.second] = true;
+  }
+  if ((size_t) std::count(live.begin(), live.end(), true) == n) {
+    return;
+  }
 
-std::vector<path_t> ConstraintState::shortest_paths_iterate(Graph &g,
-    vertex_t u,
-    std::vector<path_t> &paths,
-    bool &solution_found) {
-  dout << "shortest_paths_iterate" << std::endl;
-  if (paths.empty()) {
-    return paths;
+  Graph compacted;
+  std::vector<vertex_t> renumber(n);
+  for (vertex_t v = 0; v < n; ++v) {
+    if (live[v]) {
+      renumber[v] = boost::add_vertex(table[v], compacted);
+    }
   }
 
-  std::vector<path_t> new_paths;
-  for (auto path : paths) {
-    vertex_t n = path.front();
+  Graph::edge_iterator it, end;
+  for (std::tie(it, end) = boost::edges(table); it != end; ++it) {
+    vertex_t u = boost::source(*it, table);
+    vertex_t v = boost::target(*it, table);
+    boost::add_edge(renumber[u], renumber[v], table[*it], compacted);
+  }
 
-    dout << "  current = " << table[n] << std::endl;
+  for (auto &entry : vertex_map) {
+    entry.second = renumber[entry.second];
+  }
 
-    Graph::in_edge_iterator it, end;
-    std::tie(it, end) = boost::in_edges(n, g);
-    // extend paths by predecessor
-    for (; it != end; ++it) {
-      vertex_t pred = boost::source(*it, g);
+  if (reachability_valid) {
+    Reachability remapped;
+    remapped.clear(boost::num_vertices(compacted));
+    remapped.connected = reachability.connected;
+    for (vertex_t v = 0; v < n; ++v) {
+      if (live[v]) {
+        remapped.forward[renumber[v]] = reachability.forward[v];
+        remapped.backward[renumber[v]] = reachability.backward[v];
+      }
+    }
+    reachability = remapped;
+  }
 
-      dout << "  pred = " << table[pred] << std::endl;
+  dout << "compact : " << n << " -> " << boost::num_vertices(compacted) << " vertices" << std::endl;
+  table.swap(compacted);
+}
 
-      path_t new_path(path.begin(), path.end());
-      new_path.push_front(pred);
+//------------------------------------------------------------------------------
+// Shortest Paths
+//------------------------------------------------------------------------------
 
-      dout << "  new_path = ";
-      for (auto elem : new_path) {
-        dout << table[elem] << " ";
+/* Breadth-first search from root, following out-edges if forward is true and in-edges otherwise. On return, dist[w] is
+   the number of edges between root and w, or -1 if w is unreachable. */
+void ConstraintState::bfs_distances(vertex_t root, bool forward, std::vector<int> &dist) {
+  dist.assign(boost::num_vertices(table), -1);
+  std::vector<vertex_t> queue;
+  queue.push_back(root);
+  dist[root] = 0;
+
+  for (size_t head = 0; head < queue.size(); ++head) {
+    vertex_t w = queue[head];
+    if (forward) {
+      Graph::out_edge_iterator it, end;
+      for (std::tie(it, end) = boost::out_edges(w, table); it != end; ++it) {
+        vertex_t succ = boost::target(*it, table);
+        if (dist[succ] < 0) {
+          dist[succ] = dist[w] + 1;
+          queue.push_back(succ);
+        }
       }
-      dout << std::endl;
-
-      new_paths.push_back(new_path);
-      if (pred == u) {
-        dout << "  solution found" << std::endl;
-        solution_found = true;
+    } else {
+      Graph::in_edge_iterator it, end;
+      for (std::tie(it, end) = boost::in_edges(w, table); it != end; ++it) {
+        vertex_t pred = boost::source(*it, table);
+        if (dist[pred] < 0) {
+          dist[pred] = dist[w] + 1;
+          queue.push_back(pred);
+        }
       }
     }
   }
-
-  if (solution_found) {
-    auto is_not_solution = [u](path_t path){ return path.front() != u; };
-    new_paths.erase(std::remove_if(new_paths.begin(), new_paths.end(), is_not_solution), new_paths.end());
-  }
-
-  return new_paths;
 }
 
-std::vector<path_t> ConstraintState::shortest_paths(Graph &g, vertex_t u, vertex_t v) {
-  dout << "shortest_paths" << std::endl;
+/* Depth-first enumeration of at most k concrete shortest paths (all of them if k is negative). Only edges of the
+   shortest-path DAG are followed, so every branch explored yields at least one path. */
+void ConstraintState::enumerate_shortest_paths(const ShortestPathDAG &dag, int k, Solution &solution) {
+  typedef std::pair<Graph::out_edge_iterator, Graph::out_edge_iterator> frame_t;
 
-  std::vector<path_t> paths;
-  paths.push_back({v});
-  bool solution_found = false;
+  if (k == 0) {
+    return;
+  }
+  TRACE_SCOPE("enumerate-paths");
 
-  int limit = 100;
-  while (!solution_found) {
-    paths = shortest_paths_iterate(g, u, paths, solution_found);
+  std::vector<vertex_t> vertices;
+  std::vector<edge_t> edges;
+  std::vector<frame_t> stack;
 
-    if (solution_found) {
-      // dout << "solution found" << std::endl;
-      return paths;
-    }
+  vertices.push_back(dag.start);
+  stack.push_back(boost::out_edges(dag.start, table));
 
-    if (paths.empty()) {
-      dout << "no solutions" << std::endl;
-      return paths;
+  while (!stack.empty()) {
+    if (poll_cancel()) {
+      return;
     }
-
-    if (limit <= 0) {
-      dout << "limit reached" << std::endl;
-      return paths;
+    frame_t &frame = stack.back();
+    if (vertices.back() == dag.end) {
+      Solution::raw_t raw;
+      for (auto w : vertices) {
+        raw.push_back(table[w].positions);
+      }
+      Solution::path_solution_t path_solution;
+      for (auto e : edges) {
+        path_solution.push_back(table[e].syms);
+      }
+      solution.raws.push_back(raw);
+      solution.paths.push_back(path_solution);
+      STAT_INC(PATHS_ENUMERATED);
+      if (k > 0 && (int) solution.paths.size() >= k) {
+        return;
+      }
+    } else {
+      for (; frame.first != frame.second; ++frame.first) {
+        if (dag.contains(table, *frame.first)) {
+          break;
+        }
+      }
+      if (frame.first != frame.second) {
+        edge_t e = *frame.first;
+        ++frame.first;
+        vertex_t succ = boost::target(e, table);
+        vertices.push_back(succ);
+        edges.push_back(e);
+        stack.push_back(boost::out_edges(succ, table));
+        continue;
+      }
     }
 
-    --limit;
+    stack.pop_back();
+    vertices.pop_back();
+    if (!edges.empty()) {
+      edges.pop_back();
+    }
   }
-
-  // should be unreachable
-  return paths;
 }
 
-void ConstraintState::solve_shortest(Solution &solution) {
-  dout << "solve_shortest" << std::endl;
-
+/* Fill in dag for the current graph. Returns false if there is no path from the start node to the end node. */
+bool ConstraintState::shortest_path_dag(ShortestPathDAG &dag) {
+  TRACE_SCOPE("shortest-path");
   VertexInfo from = start_node();
   VertexInfo to = end_node();
 
   if (!has_vertex(from) || !has_vertex(to)) {
     dout << "either source or target does not exist" << std::endl;
-    return;
+    return false;
   }
 
-  vertex_t u = vertex_map[from];
-  vertex_t v = vertex_map[to];
-
-  dout << "preds begin" << std::endl;
+  dag.start = vertex_map[from];
+  dag.end = vertex_map[to];
 
-  Graph preds;
-  std::set<vertex_t> active;
-  BFSPredGraphVisitor visitor(preds, active);
-  breadth_first_search(table, u, boost::visitor(visitor));
+  if (!get_reachability().connected) {
+    dout << "start does not reach end" << std::endl;
+    return false;
+  }
 
-  dout << "preds end" << std::endl;
+  bfs_distances(dag.start, true, dag.from_start);
+  bfs_distances(dag.end, false, dag.to_end);
+  dag.length = dag.from_start[dag.end];
+  dout << "shortest path length = " << dag.length << std::endl;
+  return true;
+}
 
-  if (!has_vertex_descriptor(v, preds)) {
-    dout << "preds does not reach v" << std::endl;
-    return;
+/* If the start node has a direct edge to the end node that is labeled only with nonterminals, store it in e and return
+   true. */
+bool ConstraintState::find_unit_edge(vertex_t u, vertex_t v, edge_t &e) {
+  bool found;
+  std::tie(e, found) = boost::lookup_edge(u, v, table);
+  if (!found) {
+    return false;
   }
+  for (auto sym : table[e].syms) {
+    if (terminal_set.find(sym) != terminal_set.end()) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  dout << "preds2 begin" << std::endl;
-
-  Graph preds2;
-  std::set<vertex_t> active2;
-  BFSPredGraphVisitor visitor2(preds2, active2);
-  breadth_first_search(preds, v, boost::visitor(visitor2));
+/* Turn dag into the shortest-path DAG of the graph without its unit edge (see find_unit_edge), without recomputing any distances. Since the
+   graph is acyclic, no path from a successor of the start node can use e, so to_end is unchanged except at the start
+   node; likewise from_start is unchanged at every vertex that can still reach the end node, except the end node
+   itself. Returns false if no path is left. */
+bool ConstraintState::exclude_unit_edge(ShortestPathDAG &dag) {
+  dag.unit_edge_excluded = true;
 
-  dout << "preds2 end" << std::endl;
+  int length = -1;
+  Graph::out_edge_iterator it, end;
+  for (std::tie(it, end) = boost::out_edges(dag.start, table); it != end; ++it) {
+    vertex_t w = boost::target(*it, table);
+    if (w != dag.end && dag.to_end[w] >= 0 && (length < 0 || dag.to_end[w] + 1 < length)) {
+      length = dag.to_end[w] + 1;
+    }
+  }
 
-  auto paths = shortest_paths(preds2, u, v);
+  dag.length = length;
+  dag.to_end[dag.start] = length;
+  dag.from_start[dag.end] = length;
+  dout << "non-unit shortest path length = " << length << std::endl;
+  return length >= 0;
+}
 
-  dout << "num solution paths = " << paths.size() << std::endl;
-  for (auto i = paths.begin(); i != paths.end(); ++i) {
-    auto path = *i;
-    dout << "  path (" << path.size() <<  " vertices)" << std::endl;
+/* Read the compressed path and the number of paths directly off the layered DAG, then enumerate at most k concrete
+   paths (all of them if k is negative). */
+void ConstraintState::solve_dag(const ShortestPathDAG &dag, Solution &solution, int k) {
+  TRACE_SCOPE("solve-dag");
+  int length = dag.length;
+
+  // bucket the shortest-path DAG vertices by layer
+  std::vector<std::vector<vertex_t>> layers(length + 1);
+  Graph::vertex_iterator vit, vend;
+  for (std::tie(vit, vend) = boost::vertices(table); vit != vend; ++vit) {
+    vertex_t w = *vit;
+    if (dag.contains(w)) {
+      layers[dag.from_start[w]].push_back(w);
+    }
+  }
 
-    Solution::raw_t raw;
-    for (auto j = path.begin(); j != path.end(); ++j) {
-      vertex_t v = *j;
-      VertexInfo vi = table[v];
-      raw.push_back(vi.positions);
+  // union syms per layer, and count paths to the end node from the last layer backwards
+  std::vector<std::set<sym_t>> staging(length);
+  std::vector<double> count(boost::num_vertices(table), 0);
+  count[dag.end] = 1;
+  for (int layer = length - 1; layer >= 0; --layer) {
+    for (auto w : layers[layer]) {
+      Graph::out_edge_iterator it, end;
+      for (std::tie(it, end) = boost::out_edges(w, table); it != end; ++it) {
+        if (dag.contains(table, *it)) {
+          auto &syms = table[*it].syms;
+          staging[layer].insert(syms.begin(), syms.end());
+          count[w] += count[boost::target(*it, table)];
+        }
+      }
     }
-    solution.raws.push_back(raw);
+  }
 
-    Solution::path_solution_t path_solution;
-    for (auto j = path.begin(); j != path.end(); ++j) {
-      auto k = j;
-      ++k;
+  solution.compressed_path.clear();
+  for (auto &node : staging) {
+    solution.compressed_path.push_back(std::vector<sym_t>(node.begin(), node.end()));
+  }
+  solution.num_paths = count[dag.start];
+  dout << "num solution paths = " << solution.num_paths << std::endl;
 
-      if (k == path.end()) {
-        continue;
-      }
-      dout << "    | " << table[*j] << " -> " << table[*k] << " : ";
+  enumerate_shortest_paths(dag, k, solution);
+}
 
-      edge_t e;
-      bool found;
-      std::tie(e, found) = boost::lookup_edge(*j, *k, table);
-      if (!found) {
-        dout << "  should not happen : " << *j << " " << *k << std::endl;
-        continue;
-      }
+void ConstraintState::solve_shortest(Solution &solution) {
+  solve_shortest_k(solution, -1);
+}
 
-      auto edge_info = table[e];
-      dout << edge_info << std::endl;;
+/* Solve for the shortest paths from the start node to the end node. Instead of enumerating partial paths, compute BFS
+   layers from both ends (see ShortestPathDAG), and at most k concrete paths are enumerated (all of them if k is
+   negative). */
+void ConstraintState::solve_shortest_k(Solution &solution, int k) {
+  dout << "solve_shortest k=" << k << std::endl;
 
-      path_solution.push_back(edge_info.syms);
-    }
-    solution.paths.push_back(path_solution);
+  cancelled = false;
+  ShortestPathDAG dag;
+  if (!poll_cancel() && shortest_path_dag(dag)) {
+    solve_dag(dag, solution, k);
+  }
+  if (cancelled) {
+    solution = Solution();
   }
-  solution.compress();
 }
 
 void ConstraintState::solve_shortest_non_unit(Solution &solution) {
+  solve_shortest_non_unit_k(solution, -1);
+}
+
+void ConstraintState::solve_shortest_non_unit_k(Solution &solution, int k) {
   dout << "solve_shortest_non_unit" << std::endl;
 
   dout << "before remove : " << std::endl;
@@ -698,7 +933,33 @@ void ConstraintState::solve_shortest_non_unit(Solution &solution) {
   dout << "after remove : " << std::endl;
   dout << *this;
 
-  solve_shortest(solution);
+  solve_shortest_k(solution, k);
+}
+
+/* Equivalent to solve_shortest_k(shortest, k) followed by solve_shortest_non_unit_k(non_unit, k), but both solutions come
+   from a single pair of BFS traversals and the graph is left unmodified. */
+void ConstraintState::solve_shortest_and_non_unit(Solution &shortest, Solution &non_unit, int k) {
+  dout << "solve_shortest_and_non_unit k=" << k << std::endl;
+
+  cancelled = false;
+  ShortestPathDAG dag;
+  if (poll_cancel() || !shortest_path_dag(dag)) {
+    return;
+  }
+  solve_dag(dag, shortest, k);
+
+  edge_t e;
+  if (cancelled) {
+    shortest = Solution();
+  } else if (!find_unit_edge(dag.start, dag.end, e)) {
+    non_unit = shortest;
+  } else if (exclude_unit_edge(dag)) {
+    solve_dag(dag, non_unit, k);
+    if (cancelled) {
+      shortest = Solution();
+      non_unit = Solution();
+    }
+  }
 }
 
 bool ConstraintState::empty() {
@@ -707,6 +968,12 @@ bool ConstraintState::empty() {
   return result;
 }
 
+/* True iff there is a path from the start node to the end node. For a pruned constraint state, such as the result of
+   intersect, this is equivalent to !empty(). */
+bool ConstraintState::has_solution() {
+  return get_reachability().connected;
+}
+
 int ConstraintState::num_provenance_elements() {
   return provenance.elems.size();
 }
@@ -742,13 +1009,312 @@ void ConstraintState::get_edges(std::vector<std::vector<pos_t>> &sources,
   }
 }
 
+/* Packed wire format, used to move a whole constraint state across the embind boundary in one call. All sections are
+   flat int arrays, laid out back to back:
+
+     header       P D V E T    number of provenance elements, positions per vertex, vertices, edges, terminals
+     provenance   P * 4        sample_id nt i l
+     vertices     V * D        positions of each vertex; vertices are referred to by their index in this section
+     edge_src     E            source vertex index of each edge
+     edge_dst     E            target vertex index of each edge
+     sym_offsets  E + 1        syms of edge k are syms[sym_offsets[k] .. sym_offsets[k+1])
+     syms         sym_offsets[E]
+     terminals    T
+
+   Only live vertices (those still in vertex_map) are exported. */
+void ConstraintState::export_packed(PackedBuffer &out) {
+  out.clear();
+
+  std::vector<int> index(boost::num_vertices(table), -1);
+  std::vector<vertex_t> live;
+  Graph::vertex_iterator vit, vend;
+  for (std::tie(vit, vend) = boost::vertices(table); vit != vend; ++vit) {
+    auto found = vertex_map.find(table[*vit]);
+    if (found != vertex_map.end() && found->second == *vit) {
+      index[*vit] = live.size();
+      live.push_back(*vit);
+    }
+  }
+
+  int dim = provenance.elems.size();
+  out.push(provenance.elems.size());
+  out.push(dim);
+  out.push(live.size());
+  out.push(boost::num_edges(table));
+  out.push(terminal_set.size());
+
+  for (auto &elem : provenance.elems) {
+    out.push(elem.sample_id);
+    out.push(elem.nt);
+    out.push(elem.i);
+    out.push(elem.l);
+  }
+
+  for (auto v : live) {
+    out.append(table[v].positions);
+  }
+
+  std::vector<int> srcs, dsts, offsets, syms;
+  Graph::edge_iterator it, end;
+  for (std::tie(it, end) = boost::edges(table); it != end; ++it) {
+    srcs.push_back(index[boost::source(*it, table)]);
+    dsts.push_back(index[boost::target(*it, table)]);
+    offsets.push_back(syms.size());
+    syms.insert(syms.end(), table[*it].syms.begin(), table[*it].syms.end());
+  }
+  offsets.push_back(syms.size());
+
+  out.append(srcs);
+  out.append(dsts);
+  out.append(offsets);
+  out.append(syms);
+  out.append(std::vector<int>(terminal_set.begin(), terminal_set.end()));
+}
+
+/* Load a constraint state from the packed format written by export_packed. This must be called on an empty
+   ConstraintState. */
+void ConstraintState::load_packed(PackedBuffer &in) {
+  const int *p = in.ptr();
+  int num_provenance = *p++;
+  int dim = *p++;
+  int num_vertices = *p++;
+  int num_edges = *p++;
+  int num_terminals = *p++;
+
+  for (int k = 0; k < num_provenance; ++k, p += 4) {
+    add_provenance(p[0], p[1], p[2], p[3]);
+  }
+
+  std::vector<vertex_t> vertices;
+  for (int k = 0; k < num_vertices; ++k, p += dim) {
+    VertexInfo vi;
+    vi.positions.assign(p, p + dim);
+    vertices.push_back(_add_vertex(vi));
+  }
+
+  const int *srcs = p;
+  const int *dsts = srcs + num_edges;
+  const int *offsets = dsts + num_edges;
+  const int *syms = offsets + num_edges + 1;
+  for (int k = 0; k < num_edges; ++k) {
+    edge_t e;
+    bool _;
+    std::tie(e, _) = boost::add_edge(vertices[srcs[k]], vertices[dsts[k]], table);
+    // syms must be in sorted order for set intersection to work
+    std::vector<sym_t> &edge_syms = table[e].syms;
+    edge_syms.assign(syms + offsets[k], syms + offsets[k+1]);
+    std::sort(edge_syms.begin(), edge_syms.end());
+  }
+  invalidate_reachability();
+
+  p = syms + offsets[num_edges];
+  for (int k = 0; k < num_terminals; ++k) {
+    mark_as_terminal(*p++);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PartitionScorer
+////////////////////////////////////////////////////////////////////////////////
+
+PartitionScorer::PartitionScorer() : max_score(0) {}
+
+void PartitionScorer::add(ConstraintState &c) {
+  cs.push_back(&c);
+}
+
+int PartitionScorer::get_compat(int i, int j) {
+  return i < j ? compat[i][j] : compat[j][i];
+}
+
+/* Number of other constraint states k for which merging i and j does not change compatibility with k. */
+int PartitionScorer::score_candidate(int i, int j) {
+  ConstraintState cij;
+  ConstraintState::intersect(*cs[i], *cs[j], cij);
+
+  int result = 0;
+  for (int k = 0; k < (int) cs.size(); ++k) {
+    if (k == i || k == j) {
+      continue;
+    }
+    int ik = get_compat(i, k);
+    int jk = get_compat(j, k);
+    if (ik == jk && jk == ConstraintState::compatibility(cij, *cs[k])) {
+      ++result;
+    }
+  }
+  return result;
+}
+
+/* Compute the compatibility of every pair of constraint states, then score every compatible pair. Both phases only read
+   the input constraint states, and each work item writes to its own slot, so they are safe to run concurrently. */
+void PartitionScorer::score(int num_threads) {
+  int n = cs.size();
+
+  std::vector<std::pair<int, int>> pairs;
+  for (int i = 0; i < n; ++i) {
+    for (int j = i + 1; j < n; ++j) {
+      pairs.push_back(std::make_pair(i, j));
+    }
+  }
+
+  compat.assign(n, std::vector<int>(n, 0));
+  parallel_for(pairs.size(), num_threads, [&](int k) {
+    int i = pairs[k].first;
+    int j = pairs[k].second;
+    compat[i][j] = ConstraintState::compatibility(*cs[i], *cs[j]);
+  });
+
+  candidates.clear();
+  for (auto &pair : pairs) {
+    if (compat[pair.first][pair.second] == 1) {
+      candidates.push_back(pair);
+    }
+  }
+
+  scores.assign(candidates.size(), 0);
+  parallel_for(candidates.size(), num_threads, [&](int k) {
+    scores[k] = score_candidate(candidates[k].first, candidates[k].second);
+  });
+
+  max_score = 0;
+  for (auto score : scores) {
+    max_score = std::max(max_score, score);
+  }
+  dout << "scored " << candidates.size() << " candidates, max score = " << max_score << std::endl;
+}
+
+int PartitionScorer::num_candidates() {
+  return candidates.size();
+}
+
+int PartitionScorer::get_candidate_i(int n) {
+  return candidates[n].first;
+}
+
+int PartitionScorer::get_candidate_j(int n) {
+  return candidates[n].second;
+}
+
+int PartitionScorer::get_score(int n) {
+  return scores[n];
+}
+
+int PartitionScorer::get_max_score() {
+  return max_score;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// QuerySession
+////////////////////////////////////////////////////////////////////////////////
+
+QuerySession::QuerySession() {}
+
+void QuerySession::set_constraint(PackedBuffer &in) {
+  constraint = ConstraintState();
+  constraint.load_packed(in);
+}
+
+void QuerySession::add_query(PackedBuffer &in) {
+  queries.emplace_back();
+  queries.back().load_packed(in);
+}
+
+int QuerySession::num_queries() {
+  return queries.size();
+}
+
+void QuerySession::clear_queries() {
+  queries.clear();
+}
+
+/* Intersect the constraint with every query and solve each intersection for its shortest paths, enumerating at most k
+   concrete paths per query (all of them if k is negative). The constraint's reachability is computed once and used to
+   prune every product. The solutions are written to out as
+
+     header   Q
+     offsets  Q + 1    solution q occupies out[offsets[q] .. offsets[q+1]), in Solution::export_packed format
+
+   A query with no solution yields an empty Solution rather than being omitted, so solutions line up with queries. */
+void QuerySession::run(PackedBuffer &out, int k) {
+  TRACE_SCOPE("query-session");
+  const Reachability &live = constraint.get_reachability();
+
+  out.clear();
+  out.push(queries.size());
+  out.resize(1 + queries.size() + 1);
+
+  PackedBuffer solution_buf;
+  for (size_t q = 0; q < queries.size(); ++q) {
+    out.data[1 + q] = out.size();
+
+    ConstraintState dest;
+    ConstraintState::intersect_product(constraint, queries[q], dest, &live);
+    dest.remove_non_solution_nodes();
+
+    Solution solution;
+    dest.solve_shortest_k(solution, k);
+    solution.export_packed(solution_buf);
+    out.append(solution_buf.data);
+  }
+  out.data[1 + queries.size()] = out.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SolveBatch
+////////////////////////////////////////////////////////////////////////////////
+
+SolveBatch::SolveBatch() {}
+
+void SolveBatch::add(ConstraintState &c) {
+  cs.push_back(&c);
+}
+
+int SolveBatch::size() {
+  return cs.size();
+}
+
+/* Solve every constraint state for its shortest and non-unit shortest paths, enumerating at most k concrete paths of
+   each (all of them if k is negative). The states must be distinct objects, since each is solved on its own thread. */
+void SolveBatch::solve(int k, int num_threads) {
+  shortest.assign(cs.size(), Solution());
+  non_unit.assign(cs.size(), Solution());
+  parallel_for(cs.size(), num_threads, [&](int n) {
+    cs[n]->solve_shortest_and_non_unit(shortest[n], non_unit[n], k);
+  });
+}
+
+/* Solutions are written to out in input order, as
+
+     header   N
+     offsets  2N + 1   the shortest solution of state n occupies out[offsets[2n] .. offsets[2n+1]), and its non-unit
+                       solution out[offsets[2n+1] .. offsets[2n+2]), both in Solution::export_packed format */
+void SolveBatch::export_packed(PackedBuffer &out) {
+  out.clear();
+  out.push(cs.size());
+  out.resize(1 + 2 * shortest.size() + 1);
+
+  PackedBuffer solution_buf;
+  for (size_t n = 0; n < shortest.size(); ++n) {
+    out.data[1 + 2 * n] = out.size();
+    shortest[n].export_packed(solution_buf);
+    out.append(solution_buf.data);
+
+    out.data[2 + 2 * n] = out.size();
+    non_unit[n].export_packed(solution_buf);
+    out.append(solution_buf.data);
+  }
+  out.data[1 + 2 * shortest.size()] = out.size();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Solution
 ////////////////////////////////////////////////////////////////////////////////
 
-Solution::Solution() {}
+Solution::Solution() : num_paths(0) {}
 
 void Solution::compress() {
+  TRACE_SCOPE("compress");
   dout << "compressing " << paths.size() << " paths" << std::endl;
 
   if (paths.size() == 0) {
@@ -790,6 +1356,57 @@ void Solution::get_compressed_path(path_solution_t &output) {
   output = compressed_path;
 }
 
+double Solution::get_num_paths() {
+  return num_paths;
+}
+
+/* Packed wire format for a solution, analogous to ConstraintState::export_packed:
+
+     header              C K D     compressed path length, number of enumerated paths, positions per raw vertex
+     compressed_offsets  C + 1     syms at position k are compressed_syms[compressed_offsets[k] .. compressed_offsets[k+1])
+     compressed_syms     compressed_offsets[C]
+     raws                K * (C + 1) * D
+     path_offsets        K * C + 1  syms at position k of path p are at index p * C + k, as above
+     path_syms           path_offsets[K * C]
+
+   All enumerated paths have the same length as the compressed path, since they are all shortest paths. */
+void Solution::export_packed(PackedBuffer &out) {
+  out.clear();
+
+  int length = compressed_path.size();
+  int dim = raws.empty() || raws.front().empty() ? 0 : raws.front().front().size();
+  out.push(length);
+  out.push(paths.size());
+  out.push(dim);
+
+  std::vector<int> offsets, syms;
+  for (auto &node : compressed_path) {
+    offsets.push_back(syms.size());
+    syms.insert(syms.end(), node.begin(), node.end());
+  }
+  offsets.push_back(syms.size());
+  out.append(offsets);
+  out.append(syms);
+
+  for (auto &raw : raws) {
+    for (auto &positions : raw) {
+      out.append(positions);
+    }
+  }
+
+  offsets.clear();
+  syms.clear();
+  for (auto &path : paths) {
+    for (auto &node : path) {
+      offsets.push_back(syms.size());
+      syms.insert(syms.end(), node.begin(), node.end());
+    }
+  }
+  offsets.push_back(syms.size());
+  out.append(offsets);
+  out.append(syms);
+}
+
 std::ostream & operator<<(std::ostream &stream, const Solution &solution) {
   stream << "solution (" << solution.paths.size() << " paths) : " << std::endl;
   for (auto path : solution.paths) {
@@ -811,28 +1428,80 @@ void Solution::print() {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// BFSPredGraphVisitor
+// Reachability
 ////////////////////////////////////////////////////////////////////////////////
 
-BFSPredGraphVisitor::BFSPredGraphVisitor(Graph &preds, std::set<vertex_t> &active_vertices) : p(preds),
-  active(active_vertices) {}
+Reachability::Reachability() : connected(false) {}
 
-void BFSPredGraphVisitor::examine_vertex(const vertex_t &s, const Graph &g) const {
-  dout << "examine_vertex: " << s << " " << g[s] << std::endl;
-  Graph::out_edge_iterator it, end;
-  std::tie(it, end) = boost::out_edges(s, g);
+void Reachability::clear(size_t num_vertices) {
+  forward.clear();
+  forward.resize(num_vertices);
+  backward.clear();
+  backward.resize(num_vertices);
+  connected = false;
+}
 
-  for (; it != end; ++it) {
-    vertex_t u = boost::target(*it, g);
-    dout << "  succ: " << u << " " << g[u] << std::endl;
-    dout << "  add_edge " << u << " -> " << s << std::endl;
-    dout << "  num_vertices before add " << boost::num_vertices(p) << std::endl;
-    dout << "  num_active before add " << active.size() << std::endl;
-    boost::add_edge(u, s, p);
-    active.insert(u);
-    active.insert(s);
-    dout << "  num_vertices after add " << boost::num_vertices(p) << std::endl;
-    dout << "  num_active after add " << active.size() << std::endl;
+void Reachability::compute(const Graph &g, vertex_t u, vertex_t v) {
+  clear(boost::num_vertices(g));
+
+  std::vector<vertex_t> stack;
+  forward.set(u);
+  stack.push_back(u);
+  while (!stack.empty()) {
+    vertex_t w = stack.back();
+    stack.pop_back();
+    Graph::out_edge_iterator it, end;
+    for (std::tie(it, end) = boost::out_edges(w, g); it != end; ++it) {
+      vertex_t succ = boost::target(*it, g);
+      if (!forward.test(succ)) {
+        forward.set(succ);
+        stack.push_back(succ);
+      }
+    }
   }
+
+  connected = forward.test(v);
+  if (!connected) {
+    forward.reset();
+    return;
+  }
+
+  backward.set(v);
+  stack.push_back(v);
+  while (!stack.empty()) {
+    vertex_t w = stack.back();
+    stack.pop_back();
+    Graph::in_edge_iterator it, end;
+    for (std::tie(it, end) = boost::in_edges(w, g); it != end; ++it) {
+      vertex_t pred = boost::source(*it, g);
+      if (!backward.test(pred)) {
+        backward.set(pred);
+        stack.push_back(pred);
+      }
+    }
+  }
+}
+
+bool Reachability::on_path(vertex_t w) const {
+  return forward.test(w) && backward.test(w);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// ShortestPathDAG
+////////////////////////////////////////////////////////////////////////////////
+
+ShortestPathDAG::ShortestPathDAG() : start(0), end(0), length(-1), unit_edge_excluded(false) {}
+
+bool ShortestPathDAG::contains(vertex_t w) const {
+  return from_start[w] >= 0 && to_end[w] >= 0 && from_start[w] + to_end[w] == length;
+}
+
+/* An edge lies on some shortest path iff its endpoints are at consecutive BFS layers of the shortest-path DAG. */
+bool ShortestPathDAG::contains(const Graph &g, edge_t e) const {
+  vertex_t a = boost::source(e, g);
+  vertex_t b = boost::target(e, g);
+  if (unit_edge_excluded && a == start && b == end) {
+    return false;
+  }
+  return from_start[a] >= 0 && to_end[b] >= 0 && from_start[a] + 1 + to_end[b] == length;
+}
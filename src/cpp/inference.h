@@ -6,8 +6,12 @@
 #include <map>
 #include <memory>
 #include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/breadth_first_search.hpp>
+#include <boost/dynamic_bitset.hpp>
 #include <boost/iterator/filter_iterator.hpp>
+#include "cancel.h"
+#include "packed.h"
+#include "parser.h"
+#include "symbols.h"
 
 typedef int pos_t;
 typedef int sym_t;
@@ -74,7 +78,6 @@ typedef boost::graph_traits<Graph>::vertex_descriptor vertex_t;
 typedef boost::graph_traits<Graph>::edge_descriptor edge_t;
 
 typedef std::pair<vertex_t, vertex_t> vertex_pair_t;
-typedef std::list<vertex_t> path_t;
 
 class HasNoIncomingEdge {
   private:
@@ -92,6 +95,41 @@ class HasNoIncomingEdge {
     }
 };
 
+/** Forward reachability from the start node and backward reachability from the end node of a ConstraintState, stored
+    as bitsets indexed by vertex descriptor (these are dense, since the graph uses vecS vertex storage). A vertex lies on
+    some start-to-end path iff both of its bits are set. */
+class Reachability {
+  public:
+
+    boost::dynamic_bitset<> forward;
+    boost::dynamic_bitset<> backward;
+    bool connected; // true iff the end node is reachable from the start node
+
+    Reachability();
+
+    void compute(const Graph &g, vertex_t u, vertex_t v);
+    void clear(size_t num_vertices);
+    bool on_path(vertex_t w) const;
+};
+
+/** The DAG of shortest paths between the start and end nodes of a ConstraintState, given by BFS distances from both ends:
+    an edge a -> b is on a shortest path iff from_start[a] + 1 + to_end[b] == length. */
+class ShortestPathDAG {
+  public:
+
+    vertex_t start;
+    vertex_t end;
+    std::vector<int> from_start;
+    std::vector<int> to_end;
+    int length;
+    bool unit_edge_excluded; // true if the edge start -> end is treated as absent
+
+    ShortestPathDAG();
+
+    bool contains(vertex_t w) const;
+    bool contains(const Graph &g, edge_t e) const;
+};
+
 class Solution {
   public:
 
@@ -101,6 +139,7 @@ class Solution {
     std::vector<raw_t> raws;
     std::vector<path_solution_t> paths;
     path_solution_t compressed_path;
+    double num_paths; // total number of shortest paths, which may exceed paths.size()
 
     Solution();
 
@@ -110,6 +149,8 @@ class Solution {
     void get_raws(std::vector<raw_t> &output);
     void get_paths(std::vector<path_solution_t> &output);
     void get_compressed_path(path_solution_t &output);
+    double get_num_paths();
+    void export_packed(PackedBuffer &out);
 
     friend std::ostream & operator<<(std::ostream &stream, const Solution &solution);
 };
@@ -121,11 +162,16 @@ class ConstraintState {
     Graph table;
     std::map<VertexInfo, vertex_t> vertex_map;
     std::set<sym_t> terminal_set;
+    Reachability reachability;
+    bool reachability_valid;
+    CancelToken *cancel_token; // polled by intersect (into this state) and the solve functions, if set (not owned)
+    bool cancelled;            // whether the last such call was cancelled
 
     bool has_vertex(VertexInfo &vi);
     vertex_t _add_vertex(VertexInfo &vi);
     edge_t _add_edge(VertexInfo &from, VertexInfo &to);
-    void compute_all_path_nodes(std::set<vertex_t> &path_nodes);
+    Reachability & get_reachability();
+    void invalidate_reachability();
 
     typedef boost::filter_iterator<HasNoIncomingEdge,Graph::vertex_iterator> root_iterator;
 
@@ -133,32 +179,52 @@ class ConstraintState {
     root_iterator root_end() const;
 
     // intersection
-    static void init_node_pairs(ConstraintState &c1, ConstraintState &c2, std::set<vertex_pair_t> &node_pairs);
+    static void init_node_pairs(ConstraintState &c1, ConstraintState &c2, std::set<vertex_pair_t> &node_pairs,
+        const Reachability *live1);
     static void print_node_pairs(ConstraintState &c1, ConstraintState &c2, std::set<vertex_pair_t> &node_pairs);
-    static bool intersect_iterate(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest, std::set<vertex_pair_t> &node_pairs);
+    static void intersect_product(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest,
+        const Reachability *live1 = nullptr);
+    static bool intersect_iterate(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest,
+        std::set<vertex_pair_t> &node_pairs, std::set<vertex_pair_t> &visited, const Reachability *live1);
     static void intersect_provenance(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest);
     static void intersect_terminal_set(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest);
 
     // shortest path
-    std::vector<path_t> shortest_paths(Graph &g, vertex_t u, vertex_t v);
-    std::vector<path_t> shortest_paths_iterate(Graph &g, vertex_t u, std::vector<path_t> &paths, bool &solution_found);
+    void bfs_distances(vertex_t root, bool forward, std::vector<int> &dist);
+    bool shortest_path_dag(ShortestPathDAG &dag);
+    bool find_unit_edge(vertex_t u, vertex_t v, edge_t &e);
+    bool exclude_unit_edge(ShortestPathDAG &dag);
+    void solve_dag(const ShortestPathDAG &dag, Solution &solution, int k);
+    void enumerate_shortest_paths(const ShortestPathDAG &dag, int k, Solution &solution);
 
     // helpers
     void remove_unit_paths();
     void remove_non_solution_nodes();
-    static bool has_vertex_descriptor(vertex_t u, Graph &g);
+    bool poll_cancel();
+    void clear();
+    void add_extent_edge(pos_t i, int l, std::vector<sym_t> &syms);
 
   public:
 
     ConstraintState();
+    ConstraintState(CYK &cyk, std::vector<sym_t> &token_syms, std::vector<sym_t> &nts, std::vector<int> &constraints,
+        int sample_id, sym_t nt, pos_t i, int l);
 
     void add_provenance(int sample_id, sym_t nt, pos_t i, int l);
     void add_edge(VertexInfo &from, VertexInfo &to);
     void add_edge_sym(VertexInfo &from, VertexInfo &to, sym_t sym);
     void mark_as_terminal(sym_t sym);
+    void mark_terminals(SymbolTable &symbols);
     void solve_shortest(Solution &solution);
+    void solve_shortest_k(Solution &solution, int k);
     void solve_shortest_non_unit(Solution &solution);
+    void solve_shortest_non_unit_k(Solution &solution, int k);
+    void solve_shortest_and_non_unit(Solution &shortest, Solution &non_unit, int k);
     bool empty();
+    bool has_solution();
+    void compact();
+    void set_cancel_token(CancelToken *token);
+    bool is_cancelled();
 
     int num_provenance_elements();
     int get_provenance_sample_id(int n);
@@ -170,6 +236,9 @@ class ConstraintState {
         std::vector<std::vector<pos_t>> &targets,
         std::vector<std::vector<sym_t>> &syms);
 
+    void export_packed(PackedBuffer &out);
+    void load_packed(PackedBuffer &in);
+
     VertexInfo start_node();
     VertexInfo end_node();
 
@@ -178,18 +247,79 @@ class ConstraintState {
     friend std::ostream & operator<<(std::ostream &stream, const ConstraintState &constraint);
 
     static void intersect(ConstraintState &c1, ConstraintState &c2, ConstraintState &dest);
+    static int compatibility(ConstraintState &c1, ConstraintState &c2);
+
+    friend class QuerySession;
 };
 
-class BFSPredGraphVisitor : public boost::default_bfs_visitor {
+/** Evaluates a batch of heuristic queries against one constraint state. The constraint is loaded once and its
+    reachability is shared by every query, and all solutions come back in a single packed buffer (see run). This is the
+    cpp counterpart of run-queries in heuristic.cljs. */
+class QuerySession {
+  private:
+
+    ConstraintState constraint;
+    std::vector<ConstraintState> queries;
+
   public:
 
-    Graph &p;
-    std::set<vertex_t> &active;
+    QuerySession();
+
+    void set_constraint(PackedBuffer &in);
+    void add_query(PackedBuffer &in);
+    int num_queries();
+    void clear_queries();
+    void run(PackedBuffer &out, int k);
+};
+
+/** Solves a batch of independent constraint states (e.g., the partitions produced by partition learning) concurrently,
+    computing both the shortest and the non-unit shortest solution of each. This is the cpp counterpart of -solve-fn in
+    asm.inference. */
+class SolveBatch {
+  private:
+
+    std::vector<ConstraintState*> cs;
+    std::vector<Solution> shortest;
+    std::vector<Solution> non_unit;
+
+  public:
+
+    SolveBatch();
+
+    void add(ConstraintState &c);
+    int size();
+    void solve(int k, int num_threads);
+    void export_packed(PackedBuffer &out);
+};
+
+/** Scores the candidate merges for one iteration of partition learning. This is the cpp counterpart of
+    score-partitions in asm.inference: candidate pairs are independent of each other, so they are scored concurrently
+    when threads are available. Candidates are always reported in lexicographic [i j] order, regardless of the order in
+    which threads finish, so the winners are stable. */
+class PartitionScorer {
+  private:
+
+    std::vector<ConstraintState*> cs;
+    std::vector<std::vector<int>> compat;       // pairwise ConstraintState::compatibility, filled for i < j
+    std::vector<std::pair<int, int>> candidates;
+    std::vector<int> scores;
+    int max_score;
+
+    int get_compat(int i, int j);
+    int score_candidate(int i, int j);
+
+  public:
 
-    BFSPredGraphVisitor(Graph &preds, std::set<vertex_t> &active_vertices);
+    PartitionScorer();
 
-    void examine_vertex(const vertex_t &s, const Graph &g) const;
+    void add(ConstraintState &c);
+    void score(int num_threads);
 
+    int num_candidates();
+    int get_candidate_i(int n);
+    int get_candidate_j(int n);
+    int get_score(int n);
+    int get_max_score();
 };
 
 #endif
@@ -0,0 +1,35 @@
+#include "packed.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// PackedBuffer
+////////////////////////////////////////////////////////////////////////////////
+
+PackedBuffer::PackedBuffer() {}
+
+void PackedBuffer::clear() {
+  data.clear();
+}
+
+void PackedBuffer::resize(int n) {
+  data.resize(n);
+}
+
+int PackedBuffer::size() {
+  return data.size();
+}
+
+int PackedBuffer::get(int k) {
+  return data[k];
+}
+
+void PackedBuffer::push(int x) {
+  data.push_back(x);
+}
+
+void PackedBuffer::append(const std::vector<int> &xs) {
+  data.insert(data.end(), xs.begin(), xs.end());
+}
+
+int * PackedBuffer::ptr() {
+  return data.data();
+}
@@ -0,0 +1,26 @@
+#ifndef _packed_h
+#define _packed_h
+
+#include <cstdint>
+#include <vector>
+
+/** A flat int buffer for moving bulk data across the embind boundary in a single call. Since the contents live in the
+    Emscripten heap, JS can read (or fill) them through a typed-array view without copying; see view() in bind.cpp.
+    A view is only valid until the buffer is next resized. */
+class PackedBuffer {
+public:
+
+  std::vector<int> data;
+
+  PackedBuffer();
+
+  void clear();
+  void resize(int n);
+  int size();
+  int get(int k);
+  void push(int x);
+  void append(const std::vector<int> &xs);
+  int *ptr();
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _parallel_h
+#define _parallel_h
+
+#ifdef PARSIMONY_THREADS
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif
+
+/** Return the number of worker threads to use when the caller does not ask for a specific number. Without
+    PARSIMONY_THREADS (e.g., the default single-threaded asm.js build), this is always 1. */
+inline int default_num_threads() {
+#ifdef PARSIMONY_THREADS
+  int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+#else
+  return 1;
+#endif
+}
+
+/** Call f(k) for every k in [0, n), spread across at most num_threads threads. A non-positive num_threads means
+    default_num_threads().
+
+    Work items are claimed dynamically, so the order in which they run is unspecified. Callers must write results into
+    per-item slots and combine them afterwards, which keeps the final result independent of scheduling. */
+template<typename F>
+void parallel_for(int n, int num_threads, F f) {
+  if (num_threads <= 0) {
+    num_threads = default_num_threads();
+  }
+  if (num_threads > n) {
+    num_threads = n;
+  }
+
+#ifdef PARSIMONY_THREADS
+  if (num_threads > 1) {
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+      for (int k = next++; k < n; k = next++) {
+        f(k);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads; ++t) {
+      threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    return;
+  }
+#endif
+
+  for (int k = 0; k < n; ++k) {
+    f(k);
+  }
+}
+
+#endif
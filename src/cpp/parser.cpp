@@ -1,6 +1,12 @@
 #include "parser.h"
 #include "debug.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
 #include <algorithm>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Dynamic Matrices
@@ -8,6 +14,7 @@
 
 template<typename T>
 T** table2d(int n, int m) {
+  STAT_ADD(TABLE_BYTES, n * sizeof(T*) + (size_t)n * m * sizeof(T));
   T **table = new T*[n];
   for (int i = 0; i < n; ++i) {
     table[i] = new T[m]();
@@ -26,6 +33,7 @@ void delete_table2d(T **table, int n) {
 
 template<typename T>
 T*** table3d(int n, int m, int l) {
+  STAT_ADD(TABLE_BYTES, n * sizeof(T**) + (size_t)n * m * sizeof(T*) + (size_t)n * m * l * sizeof(T));
   T ***table = new T**[n];
   for (int i = 0; i < n; ++i) {
     table[i] = new T*[m];
@@ -36,30 +44,113 @@ T*** table3d(int n, int m, int l) {
   return table;
 }
 
+/* Free a table, except for rows [i][j] with borrowed[i][j], which belong to another table. */
 template<typename T>
-void delete_table3d(T ***table, int n, int m) {
+void delete_table3d(T ***table, int n, int m, bool **borrowed = nullptr) {
   for (int i = 0; i < n; ++i) {
     for (int j = 0; j < m; ++j) {
-      delete[] table[i][j];
+      if (!borrowed || !borrowed[i][j]) {
+        delete[] table[i][j];
+      }
     }
     delete [] table[i];
   }
   delete[] table;
 }
 
+/* Extend an n by m table to new_n by m, keeping the existing rows and value-initializing new ones. */
+template<typename T>
+T** grow_table2d(T **table, int n, int new_n, int m) {
+  STAT_ADD(TABLE_BYTES, new_n * sizeof(T*) + (size_t)(new_n - n) * m * sizeof(T));
+  T **result = new T*[new_n];
+  std::copy(table, table + n, result);
+  for (int i = n; i < new_n; ++i) {
+    result[i] = new T[m]();
+  }
+  delete[] table;
+  return result;
+}
+
+/* Extend an n by m by l table to new_n by m by l, keeping the existing rows and filling new ones with value. */
+template<typename T>
+T*** grow_table3d(T ***table, int n, int new_n, int m, int l, T value) {
+  STAT_ADD(TABLE_BYTES, new_n * sizeof(T**) + (size_t)(new_n - n) * m * (sizeof(T*) + l * sizeof(T)));
+  T ***result = new T**[new_n];
+  std::copy(table, table + n, result);
+  for (int i = n; i < new_n; ++i) {
+    result[i] = new T*[m];
+    for (int j = 0; j < m; ++j) {
+      result[i][j] = new T[l];
+      std::fill(result[i][j], result[i][j] + l, value);
+    }
+  }
+  delete[] table;
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fingerprints
+////////////////////////////////////////////////////////////////////////////////
+
+/* 64-bit FNV-1a over a sequence of ints, for the content hashes of Grammar::fingerprint and BasicCYK::fingerprint. If
+   words is set, the ints are also appended to it, so that a caller can tell apart contents whose hashes collide. */
+struct Fingerprint {
+  uint64_t hash = 14695981039346656037ULL;
+  std::vector<int> *words;
+
+  Fingerprint(std::vector<int> *words): words(words) {}
+
+  void add(int x) {
+    for (int b = 0; b < 4; ++b) {
+      hash ^= (x >> (8 * b)) & 0xff;
+      hash *= 1099511628211ULL;
+    }
+    if (words) {
+      words->push_back(x);
+    }
+  }
+};
+
+/* The bits of a value of up to 4 bytes (e.g., a float weight) as an int, for packing and hashing. */
+template<typename T>
+int to_word(T x) {
+  static_assert(sizeof(T) <= sizeof(int), "to_word needs a type of at most 4 bytes");
+  int w = 0;
+  std::memcpy(&w, &x, sizeof(T));
+  return w;
+}
+
+template<typename T>
+T from_word(int w) {
+  T x;
+  std::memcpy(&x, &w, sizeof(T));
+  return x;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Grammar
 ////////////////////////////////////////////////////////////////////////////////
 
-Grammar::Grammar(int n, int m): n(n), m(m) {
+Grammar::Grammar(int n, int m): n(n), m(m), filtered(false) {
   table = table3d<int>(n, m, 3);
+  weights = table2d<float>(n, m);
+  filters = table2d<int>(n, m);
+  classes = table2d<int>(n, m);
+  child_filters.push_back(ChildFilter{0, 0});
 }
 
+/* A grammar over every symbol interned in symbols so far. Symbols interned later must not appear in its rules. */
+Grammar::Grammar(SymbolTable &symbols, int m): Grammar(symbols.size(), m) {}
+
 Grammar::~Grammar() {
   delete_table3d<int>(table, n, m);
+  delete_table2d<float>(weights, n);
+  delete_table2d<int>(filters, n);
+  delete_table2d<int>(classes, n);
 }
 
-void Grammar::add(int l, int r1, int r2) {
+/* Add the rule l -> r1 r2 and return its column in the row of l. */
+int Grammar::append(int l, int r1, int r2) {
   int **row = table[l];
   int empty_col = 0;
   for (int i = 0; i < m; i++) {
@@ -71,12 +162,158 @@ void Grammar::add(int l, int r1, int r2) {
   row[empty_col][0] = l;
   row[empty_col][1] = r1;
   row[empty_col][2] = r2;
+  return empty_col;
+}
+
+void Grammar::add(int l, int r1, int r2) {
+  append(l, r1, r2);
+}
+
+void Grammar::add_weighted(int l, int r1, int r2, float weight) {
+  weights[l][append(l, r1, r2)] = weight;
+}
+
+/* Register a filter forbidding the given masks of classes as first and last child, and return its index. */
+int Grammar::add_child_filter(int first, int last) {
+  child_filters.push_back(ChildFilter{(class_mask)first, (class_mask)last});
+  return child_filters.size() - 1;
+}
+
+/* Add the rule l -> r1 r2, which checks its children against the given child filter and derives class cls. */
+void Grammar::add_filtered(int l, int r1, int r2, int filter, int cls) {
+  int j = append(l, r1, r2);
+  filters[l][j] = filter;
+  classes[l][j] = cls;
+  filtered = true;
+}
+
+/* Return, for each symbol x, x and every symbol that reaches x by following parents. */
+static std::vector<std::vector<int> > closures(const std::vector<std::vector<int> > &parents) {
+  int n = parents.size();
+  std::vector<std::vector<int> > result(n);
+  std::vector<bool> seen(n);
+  for (int x = 1; x < n; ++x) {
+    std::vector<int> &closure = result[x];
+    std::fill(seen.begin(), seen.end(), false);
+    seen[x] = true;
+    closure.push_back(x);
+    for (size_t c = 0; c < closure.size(); ++c) {
+      for (int y : parents[closure[c]]) {
+        if (!seen[y]) {
+          seen[y] = true;
+          closure.push_back(y);
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/* Compute left_closure and right_closure (the inverse FIRST and LAST relations over symbols), unless already done.
+   Rules must not be added afterwards. */
+void Grammar::analyze() {
+  if (!left_closure.empty()) {
+    return;
+  }
+  // left_parents[a] (right_parents[b]) are the symbols with a production whose first (last) symbol is a (b)
+  std::vector<std::vector<int> > left_parents(n), right_parents(n);
+  for (int l = 1; l < n; ++l) {
+    for (int j = 0; j < m && table[l][j][0] != 0; ++j) {
+      left_parents[table[l][j][1]].push_back(l);
+      right_parents[table[l][j][2]].push_back(l);
+    }
+  }
+  left_closure = closures(left_parents);
+  right_closure = closures(right_parents);
 }
 
 int** Grammar::productions_with_lhs(int l) {
   return table[l];
 }
 
+/* Does l have the same productions here as in other, with the same weights, child filters and classes? The order of
+   productions does not matter. */
+bool Grammar::same_productions(Grammar &other, int l) {
+  typedef std::tuple<int, int, float, class_mask, class_mask, int> production;
+  auto productions = [l](Grammar &g) {
+    std::vector<production> result;
+    for (int j = 0; j < g.m && g.table[l][j][0] != 0; ++j) {
+      const ChildFilter &filter = g.child_filters[g.filters[l][j]];
+      result.push_back(production(g.table[l][j][1], g.table[l][j][2], g.weights[l][j],
+                                  filter.first, filter.last, g.classes[l][j]));
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  };
+  return productions(*this) == productions(other);
+}
+
+/* Return changed extended with every symbol that has a production with an affected child, i.e., every symbol whose
+   derivations may differ if the symbols in changed do. */
+std::vector<bool> Grammar::dependents(const std::vector<bool> &changed) {
+  std::vector<std::vector<int> > parents(n);
+  for (int l = 1; l < n; ++l) {
+    for (int j = 0; j < m && table[l][j][0] != 0; ++j) {
+      parents[table[l][j][1]].push_back(l);
+      parents[table[l][j][2]].push_back(l);
+    }
+  }
+  std::vector<bool> affected(changed);
+  std::vector<int> work;
+  for (int x = 1; x < n; ++x) {
+    if (affected[x]) {
+      work.push_back(x);
+    }
+  }
+  while (!work.empty()) {
+    int x = work.back();
+    work.pop_back();
+    for (int p : parents[x]) {
+      if (!affected[p]) {
+        affected[p] = true;
+        work.push_back(p);
+      }
+    }
+  }
+  return affected;
+}
+
+void Grammar::swap(Grammar &other) {
+  std::swap(n, other.n);
+  std::swap(m, other.m);
+  std::swap(table, other.table);
+  std::swap(weights, other.weights);
+  std::swap(filters, other.filters);
+  std::swap(classes, other.classes);
+  std::swap(child_filters, other.child_filters);
+  std::swap(filtered, other.filtered);
+  std::swap(left_closure, other.left_closure);
+  std::swap(right_closure, other.right_closure);
+}
+
+/* A content hash of the rules, their weights and their filters, also appended to words if set. Equal grammars over the
+   same symbol ids have equal fingerprints, whatever the number of symbols interned since; rules are hashed in the order
+   they were added. */
+uint64_t Grammar::fingerprint(std::vector<int> *words) {
+  Fingerprint f(words);
+  f.add(filtered);
+  for (int l = 1; l < n; ++l) {
+    for (int j = 0; j < m && table[l][j][0] != 0; ++j) {
+      f.add(l);
+      f.add(table[l][j][1]);
+      f.add(table[l][j][2]);
+      f.add(to_word(weights[l][j]));
+      f.add(filters[l][j]);
+      f.add(classes[l][j]);
+    }
+  }
+  for (auto &filter : child_filters) {
+    f.add(filter.first);
+    f.add(filter.last);
+  }
+  return f.hash;
+}
+
 void Grammar::print() {
   printf("Printing grammar [n = %d, m = %d]\n", n, m);
   for (int i = 0; i < n; ++i) {
@@ -98,15 +335,15 @@ void Grammar::print() {
 ColorSet::ColorSet() {}
 
 void ColorSet::add(int _nt, int _i, int _l) {
-  bool not_found = true;
-
-  for (int i = 0; i < nts.size(); ++i) {
+  for (size_t i = 0; i < nts.size(); ++i) {
     if (nts[i] == _nt && is[i] == _i && ls[i] == _l) {
       DEBUG_PRINT(("already exists\n"));
+      STAT_INC(COLOR_DEDUPE_HITS);
       return;
     }
   }
 
+  STAT_INC(COLOR_ENTRIES);
   nts.push_back(_nt);
   is.push_back(_i);
   ls.push_back(_l);
@@ -163,138 +400,1068 @@ std::ostream & operator<<(std::ostream &strm, const Score &s) {
 // CYK
 ////////////////////////////////////////////////////////////////////////////////
 
-CYK::CYK(int n, int m, Grammar &g): n(n), m(m), grammar(g) {
-  lmax = 1+m;
-  cyk_table = table3d<bool>(n, m, lmax);
+template<typename S>
+BasicCYK<S>::BasicCYK(int n, int m, Grammar &g, int max_span): n(n), m(m), grammar(g), owns_grammar(true) {
+  TRACE_SCOPE("cyk-init");
+  lmax = 1 + (max_span > 0 && max_span < m ? max_span : m);
+  cyk_table = table3d<value_type>(n, m, lmax);
+  if (!(S::zero() == value_type())) {
+    // entries start out zero, and a value-initialized entry would read as pinned (see match)
+    for (int nt = 0; nt < n; ++nt) {
+      for (int i = 0; i < m; ++i) {
+        std::fill(cyk_table[nt][i], cyk_table[nt][i] + lmax, S::zero());
+      }
+    }
+  }
+  class_table = g.filtered ? table3d<Grammar::class_mask>(n, m, lmax) : nullptr;
+  known_table = nullptr;
+  dirty_table = nullptr;
+  borrowed = nullptr;
+  starts_table = nullptr;
+  ends_table = nullptr;
   col_table = table2d<ColorSet>(m, lmax);
   score_table = table2d<Score>(m, lmax);
+  resume_l = 2;
+  resume_color_l = 0;
+  cancel_token = nullptr;
+  cancelled = false;
+  interrupted = false;
+  pruning = true;
 }
 
-CYK::~CYK() {
-  delete_table3d<bool>(cyk_table, n, m);
+/* A CYK table over the same symbols as the grammar. With a positive max_span below m, the table is bounded: only spans
+   of up to max_span tokens are parsed (so storage and parse time grow linearly with m), entries for longer spans are
+   zero, and colorize covers the whole input with the best sequence of bounded spans. */
+template<typename S>
+BasicCYK<S>::BasicCYK(int m, Grammar &g, int max_span): BasicCYK(g.n, m, g, max_span) {}
+
+template<typename S>
+BasicCYK<S>::~BasicCYK() {
+  delete_table3d<value_type>(cyk_table, n, m, borrowed);
+  if (class_table) {
+    delete_table3d<Grammar::class_mask>(class_table, n, m, borrowed);
+  }
+  if (borrowed) {
+    delete_table2d<bool>(borrowed, n);
+  }
+  if (known_table) {
+    delete_table3d<bool>(known_table, n, m);
+  }
+  if (starts_table) {
+    delete_table2d<bool>(starts_table, n);
+    delete_table2d<bool>(ends_table, n);
+  }
   delete_table2d<ColorSet>(col_table, m);
   delete_table2d<Score>(score_table, m);
+  if (dirty_table) {
+    delete_table2d<bool>(dirty_table, m);
+  }
 
   // The following is kind of unsafe: deleting the grammar even though it was initialized
   // in another scope. We do this because we know that no other reference to the grammar
   // escapes from asm.parser/cpp-init-cyk, so this instance holds the only reference
   // to the grammar.
-  delete &grammar;
+  if (owns_grammar) {
+    delete &grammar;
+  }
 }
 
-void CYK::set_cyk(int nt, int i, int l) {
-  cyk_table[nt][i][l] = true;
+template<typename S>
+void BasicCYK<S>::set_cyk(int nt, int i, int l) {
+  if (l >= lmax) {
+    return;
+  }
+  if (l > 1 && !starts_table) {
+    pins.push_back(nt);
+    pins.push_back(i);
+    pins.push_back(l);
+  }
+  if (l == 1 && starts_table && cyk_table[nt][i][l] == S::zero()) {
+    touched.push_back(nt);
+    touched.push_back(i);
+  }
+  if (borrowed) {
+    own_row(nt, i);
+    changes.push_back(nt);
+    changes.push_back(i);
+    changes.push_back(l);
+    if (l > 1) {
+      pins.push_back(nt);
+      pins.push_back(i);
+      pins.push_back(l);
+    }
+  }
+  cyk_table[nt][i][l] = S::one();
+  if (class_table) {
+    class_table[nt][i][l] = 1;
+  }
 }
 
-void CYK::unset_cyk(int nt, int i, int l) {
-  cyk_table[nt][i][l] = false;
+template<typename S>
+void BasicCYK<S>::unset_cyk(int nt, int i, int l) {
+  if (l >= lmax) {
+    return;
+  }
+  if (l == 1 && starts_table && !(cyk_table[nt][i][l] == S::zero())) {
+    touched.push_back(nt);
+    touched.push_back(i);
+  }
+  if (borrowed) {
+    own_row(nt, i);
+    changes.push_back(nt);
+    changes.push_back(i);
+    changes.push_back(l);
+    for (size_t p = 0; p < pins.size(); p += 3) {
+      if (pins[p] == nt && pins[p+1] == i && pins[p+2] == l) {
+        pins.erase(pins.begin() + p, pins.begin() + p + 3);
+        break;
+      }
+    }
+  }
+  cyk_table[nt][i][l] = S::zero();
+  if (class_table) {
+    class_table[nt][i][l] = 0;
+  }
 }
 
-bool CYK::get_cyk(int nt, int i, int l) {
+template<typename S>
+bool BasicCYK<S>::get_cyk(int nt, int i, int l) {
+  if (l >= lmax) {
+    return false;
+  }
+  if (known_table && !is_known(nt, i, l)) {
+    evaluate(nt, i, l);
+  }
+  return !(cyk_table[nt][i][l] == S::zero());
+}
+
+template<typename S>
+typename BasicCYK<S>::value_type BasicCYK<S>::get_value(int nt, int i, int l) {
+  if (l >= lmax) {
+    return S::zero();
+  }
+  if (known_table && !is_known(nt, i, l)) {
+    evaluate(nt, i, l);
+  }
   return cyk_table[nt][i][l];
 }
 
-int CYK::get_lmax() {
+template<typename S>
+int BasicCYK<S>::get_lmax() {
   return lmax;
 }
 
-/* Perform a complete parse. This may block for a long time. */
-void CYK::parse() {
-  for (int l = 2; l < lmax; ++l) {
-    for (int nt = 1; nt < n; ++nt) {
-      for (int i = 0; i <= m-l; ++i) {
-        cyk_table[nt][i][l] = match(nt, i, l);
+template<typename S>
+int BasicCYK<S>::get_n() {
+  return n;
+}
+
+template<typename S>
+int BasicCYK<S>::get_m() {
+  return m;
+}
+
+/* Perform a complete parse. This may block for a long time, unless the cancel token is set: then it stops at the next
+   diagonal, and the next call resumes from there. */
+template<typename S>
+void BasicCYK<S>::parse() {
+  if (borrowed) {
+    parse_fork();
+    return;
+  }
+  TRACE_SCOPE("parse");
+  cancelled = false;
+  prepare();
+  for (int l = resume_l; l < lmax; ++l) {
+    if (poll_cancel()) {
+      resume_l = l;
+      // in lazy mode, known_table says which entries are computed, so a partial parse is still consistent
+      interrupted = !known_table;
+      return;
+    }
+    TRACE_SCOPE_ARG("parse-diagonal", "l", l);
+    for (int i = 0; i <= m-l; ++i) {
+      for (int nt : candidates[i]) {
+        if (ends_table[nt][i+l-1]) {
+          compute(nt, i, l);
+        }
       }
     }
   }
+  resume_l = lmax;
+  interrupted = false;
 }
 
 /* Parse for only some values of l, then return the next value of l to use. The purpose of this method is for use in
    interactive environments where a long-running blocking call can cause the interface to become unresponsive. Instead,
    the caller must call parse_partial for each value of l, redraw, then call parse_partial on the next value of l, and
    so on until all values of l have been covered, which is indicated by a return value of 0. */
-int CYK::parse_partial(int l) {
+template<typename S>
+int BasicCYK<S>::parse_partial(int l) {
+  TRACE_SCOPE_ARG("parse-partial", "l", l);
+  own_all();
+  prepare();
   int next_l = l + 10;
   for (; l < lmax && l < next_l; ++l) {
-    for (int nt = 1; nt < n; ++nt) {
-      for (int i = 0; i <= m-l; ++i) {
-        cyk_table[nt][i][l] = match(nt, i, l);
+    TRACE_SCOPE_ARG("parse-diagonal", "l", l);
+    for (int i = 0; i <= m-l; ++i) {
+      for (int nt : candidates[i]) {
+        if (ends_table[nt][i+l-1]) {
+          compute(nt, i, l);
+        }
       }
     }
   }
   if (l == lmax) {
+    resume_l = lmax;
+    interrupted = false;
     return 0;
   } else {
     return next_l;
   }
 }
 
-bool CYK::match(int nt, int i, int l) {
-  // an initially true value is treated specially to mean "this entry is pinned to false"
-  if (cyk_table[nt][i][l]) {
+/* Switch to lazy mode, in which entries are computed on demand: get_cyk and get_value compute only the entries that the
+   requested one depends on, and parse and parse_partial skip entries that are already known, so either kind of query
+   reuses the work of the other. */
+template<typename S>
+void BasicCYK<S>::parse_lazy() {
+  if (known_table) {
+    return;
+  }
+  own_all();
+  prepare();
+  known_table = table3d<bool>(n, m, lmax);
+}
+
+/* Restrict every entry with l > 1 to candidate symbols, going by the l = 1 entries, which must be set beforehand. A
+   symbol is a candidate for (i, l) if it is derivable, some derivation of it can start with a symbol of token i
+   (FIRST), and some derivation of it can end with a symbol of token i+l-1 (LAST). A symbol is derivable if it has a
+   production whose children are derivable or have l = 1 entries. Entries of other symbols are never computed, so
+   pinned ones are cleared here. Does nothing after the first call. */
+template<typename S>
+void BasicCYK<S>::prepare() {
+  if (starts_table) {
+    return;
+  }
+  TRACE_SCOPE("prepare");
+  grammar.analyze();
+  starts_table = table2d<bool>(n, m);
+  ends_table = table2d<bool>(n, m);
+
+  if (!pruning) {
+    // every symbol is a candidate everywhere
+    for (int nt = 1; nt < n; ++nt) {
+      std::fill(starts_table[nt], starts_table[nt] + m, true);
+      std::fill(ends_table[nt], ends_table[nt] + m, true);
+    }
+    derivable.assign(n, true);
+    candidates.assign(m, std::vector<int>());
+    for (int i = 0; i < m; ++i) {
+      for (int nt = 1; nt < n; ++nt) {
+        candidates[i].push_back(nt);
+      }
+    }
+    return;
+  }
+
+  std::vector<bool> leaf(n);
+  for (int x = 1; x < n; ++x) {
+    for (int i = 0; i < m; ++i) {
+      if (cyk_table[x][i][1] == S::zero()) {
+        continue;
+      }
+      leaf[x] = true;
+      for (int y : grammar.left_closure[x]) {
+        starts_table[y][i] = true;
+      }
+      for (int y : grammar.right_closure[x]) {
+        ends_table[y][i] = true;
+      }
+    }
+  }
+
+  derivable.assign(n, false);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int nt = 1; nt < n; ++nt) {
+      int **ps = grammar.productions_with_lhs(nt);
+      for (int j = 0; j < grammar.m && ps[j][0] != 0 && !derivable[nt]; ++j) {
+        int a = ps[j][1];
+        int b = ps[j][2];
+        if ((leaf[a] || derivable[a]) && (leaf[b] || derivable[b])) {
+          derivable[nt] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  candidates.assign(m, std::vector<int>());
+  for (int nt = 1; nt < n; ++nt) {
+    if (!derivable[nt]) {
+      continue;
+    }
+    for (int i = 0; i < m; ++i) {
+      if (starts_table[nt][i]) {
+        candidates[i].push_back(nt);
+      }
+    }
+  }
+  DEBUG_PRINT(("prepare: %d derivable symbols\n", (int)std::count(derivable.begin(), derivable.end(), true)));
+
+  for (size_t p = 0; p < pins.size(); p += 3) {
+    int nt = pins[p], i = pins[p+1], l = pins[p+2];
+    if (!is_candidate(nt, i, l) && !(cyk_table[nt][i][l] == S::zero())) {
+      own_row(nt, i);
+      cyk_table[nt][i][l] = S::zero();
+      if (class_table) {
+        class_table[nt][i][l] = 0;
+      }
+    }
+  }
+}
+
+/* Candidate pruning is on by default. Turning it off makes every symbol a candidate for every entry, which gives the
+   same table, only slower; this is for checking and measuring the pruning. Has no effect once parsing has started. */
+template<typename S>
+void BasicCYK<S>::set_pruning(bool on) {
+  pruning = on;
+}
+
+template<typename S>
+bool BasicCYK<S>::is_candidate(int nt, int i, int l) {
+  return derivable[nt] && starts_table[nt][i] && ends_table[nt][i+l-1];
+}
+
+/* Extend the table with empty rows for symbols interned since it was created, for new_n symbols in all (counting the
+   0 sentinel, like Grammar::n). */
+template<typename S>
+void BasicCYK<S>::add_symbols(int new_n) {
+  if (new_n <= n) {
+    return;
+  }
+  own_all();
+  cyk_table = grow_table3d<value_type>(cyk_table, n, new_n, m, lmax, S::zero());
+  if (class_table) {
+    class_table = grow_table3d<Grammar::class_mask>(class_table, n, new_n, m, lmax, 0);
+  }
+  if (known_table) {
+    known_table = grow_table3d<bool>(known_table, n, new_n, m, lmax, false);
+  }
+  if (starts_table) {
+    starts_table = grow_table2d<bool>(starts_table, n, new_n, m);
+    ends_table = grow_table2d<bool>(ends_table, n, new_n, m);
+    derivable.resize(new_n, false);
+  }
+  n = new_n;
+}
+
+/* Switch to next, a grammar over the same symbols (e.g., after an edit to some productions), and bring the table up to
+   date with it. A symbol is affected if its productions changed, one of its l = 1 entries was set or unset after
+   parsing, or it has a production with an affected child (see Grammar::dependents). Only the entries of affected
+   symbols are recomputed, in order of increasing l, since an entry only depends on shorter ones; pins are kept. Spans
+   where the entry of a symbol that is not ignored changed are recorded for recolorize. In lazy mode, the entries of
+   affected symbols are just forgotten.
+
+   Symbols interned after the table was created (e.g., for new intermediate symbols) get new rows, see add_symbols. Takes
+   ownership of next, like the constructor does of its grammar, and returns the number of affected symbols. If next has
+   fewer symbols, returns -1 and does nothing, so the caller keeps next and must parse anew. */
+template<typename S>
+int BasicCYK<S>::reparse(Grammar &next) {
+  TRACE_SCOPE("reparse");
+  if (next.n < n || interrupted) {
+    return -1;
+  }
+  own_all();
+
+  std::vector<bool> changed(next.n);
+  for (int nt = 1; nt < next.n; ++nt) {
+    changed[nt] = nt >= grammar.n || next.filtered != grammar.filtered || !grammar.same_productions(next, nt);
+  }
+  std::vector<int> tokens; // (nt, i) pairs of changed l = 1 entries
+  tokens.swap(touched);
+  for (size_t p = 0; p < tokens.size(); p += 2) {
+    changed[tokens[p]] = true;
+  }
+  std::vector<bool> affected = next.dependents(changed);
+  std::vector<int> nts;
+  for (int nt = 1; nt < next.n; ++nt) {
+    if (affected[nt]) {
+      nts.push_back(nt);
+    }
+  }
+  DEBUG_PRINT(("reparse: %d affected symbols\n", (int)nts.size()));
+
+  // the candidates of affected symbols may differ under the new grammar, see prepare below
+  bool parsed = starts_table;
+  if (parsed) {
+    delete_table2d<bool>(starts_table, n);
+    delete_table2d<bool>(ends_table, n);
+    starts_table = nullptr;
+    ends_table = nullptr;
+  }
+  add_symbols(next.n);
+
+  grammar.swap(next);
+  delete &next;
+  if (grammar.filtered && !class_table) {
+    class_table = table3d<Grammar::class_mask>(n, m, lmax);
+    for (int nt = 1; nt < n; ++nt) {
+      for (int i = 0; i < m; ++i) {
+        class_table[nt][i][1] = cyk_table[nt][i][1] == S::zero() ? 0 : 1;
+      }
+    }
+  } else if (!grammar.filtered && class_table) {
+    delete_table3d<Grammar::class_mask>(class_table, n, m);
+    class_table = nullptr;
+  }
+  if (!parsed) {
+    return nts.size();
+  }
+  prepare();
+
+  if (!dirty_table) {
+    dirty_table = table2d<bool>(m, lmax);
+  }
+  for (size_t p = 0; p < tokens.size(); p += 2) {
+    if (!is_ignored(tokens[p])) {
+      dirty_table[tokens[p+1]][1] = true;
+    }
+  }
+
+  std::set<std::tuple<int, int, int> > pinned;
+  for (size_t p = 0; p < pins.size(); p += 3) {
+    if (affected[pins[p]]) {
+      pinned.insert(std::make_tuple(pins[p], pins[p+1], pins[p+2]));
+    }
+  }
+  for (int l = 2; l < lmax; ++l) {
+    for (int i = 0; i <= m-l; ++i) {
+      for (int nt : nts) {
+        value_type old = cyk_table[nt][i][l];
+        cyk_table[nt][i][l] = pinned.count(std::make_tuple(nt, i, l)) ? S::one() : S::zero();
+        if (class_table) {
+          class_table[nt][i][l] = 0;
+        }
+        if (known_table) {
+          known_table[nt][i][l] = false;
+          dirty_table[i][l] = true;
+          continue;
+        }
+        if (is_candidate(nt, i, l)) {
+          compute(nt, i, l);
+        } else {
+          cyk_table[nt][i][l] = S::zero();
+        }
+        if (!is_ignored(nt) && (old == S::zero()) != (cyk_table[nt][i][l] == S::zero())) {
+          dirty_table[i][l] = true;
+        }
+      }
+    }
+  }
+  return nts.size();
+}
+
+/* Return a snapshot of this table, which must be parsed, that shares its rows until it writes them. The fork can be
+   constrained further with set_cyk and unset_cyk, after which its parse only recomputes the entries that may depend on
+   the changed ones (see parse_fork). This table must outlive the fork and must not change while the fork exists. Lazy
+   tables cannot be forked; for them, and for tables that are not parsed, returns nullptr. */
+template<typename S>
+BasicCYK<S> *BasicCYK<S>::fork() {
+  if (known_table || !starts_table) {
+    return nullptr;
+  }
+  return new BasicCYK(*this);
+}
+
+/* A fork of base, see fork. Only the row pointers are copied, and the colorings start out empty. */
+template<typename S>
+BasicCYK<S>::BasicCYK(BasicCYK &base):
+  n(base.n), m(base.m), lmax(base.lmax), derivable(base.derivable), candidates(base.candidates), pins(base.pins),
+  resume_l(base.resume_l), resume_color_l(0), cancel_token(base.cancel_token), cancelled(false), interrupted(base.interrupted), pruning(base.pruning),
+  ignored(base.ignored), grammar(base.grammar), owns_grammar(false) {
+  cyk_table = new value_type**[n];
+  class_table = base.class_table ? new Grammar::class_mask**[n] : nullptr;
+  borrowed = table2d<bool>(n, m);
+  for (int nt = 0; nt < n; ++nt) {
+    cyk_table[nt] = new value_type*[m];
+    std::copy(base.cyk_table[nt], base.cyk_table[nt] + m, cyk_table[nt]);
+    if (class_table) {
+      class_table[nt] = new Grammar::class_mask*[m];
+      std::copy(base.class_table[nt], base.class_table[nt] + m, class_table[nt]);
+    }
+    std::fill(borrowed[nt], borrowed[nt] + m, true);
+  }
+  known_table = nullptr;
+  starts_table = table2d<bool>(n, m);
+  ends_table = table2d<bool>(n, m);
+  for (int nt = 0; nt < n; ++nt) {
+    std::copy(base.starts_table[nt], base.starts_table[nt] + m, starts_table[nt]);
+    std::copy(base.ends_table[nt], base.ends_table[nt] + m, ends_table[nt]);
+  }
+  col_table = table2d<ColorSet>(m, lmax);
+  score_table = table2d<Score>(m, lmax);
+  dirty_table = nullptr;
+}
+
+template<typename S>
+void BasicCYK<S>::own_row(int nt, int i) {
+  if (!borrowed || !borrowed[nt][i]) {
+    return;
+  }
+  STAT_ADD(TABLE_BYTES, lmax * (sizeof(value_type) + (class_table ? sizeof(Grammar::class_mask) : 0)));
+  value_type *row = new value_type[lmax];
+  std::copy(cyk_table[nt][i], cyk_table[nt][i] + lmax, row);
+  cyk_table[nt][i] = row;
+  if (class_table) {
+    Grammar::class_mask *classes = new Grammar::class_mask[lmax];
+    std::copy(class_table[nt][i], class_table[nt][i] + lmax, classes);
+    class_table[nt][i] = classes;
+  }
+  borrowed[nt][i] = false;
+}
+
+template<typename S>
+void BasicCYK<S>::own_all() {
+  if (!borrowed) {
+    return;
+  }
+  for (int nt = 0; nt < n; ++nt) {
+    for (int i = 0; i < m; ++i) {
+      own_row(nt, i);
+    }
+  }
+  delete_table2d<bool>(borrowed, n);
+  borrowed = nullptr;
+}
+
+/* Bring a fork up to date with the entries set or unset since it was forked or last parsed. An entry can only change
+   if its symbol depends on the symbol of a changed entry (see Grammar::dependents) and its span contains the changed
+   entry's span, so only those entries are recomputed, in order of increasing l. */
+template<typename S>
+void BasicCYK<S>::parse_fork() {
+  if (changes.empty()) {
+    return;
+  }
+  TRACE_SCOPE("parse-fork");
+  std::vector<bool> changed(n);
+  bool **dirty = table2d<bool>(m, lmax);
+  bool new_leaves = false;
+  for (size_t p = 0; p < changes.size(); p += 3) {
+    int nt = changes[p], i = changes[p+1], l = changes[p+2];
+    changed[nt] = true;
+    dirty[i][l] = true;
+    new_leaves = new_leaves || (l == 1 && !(cyk_table[nt][i][1] == S::zero()));
+  }
+  changes.clear();
+  if (new_leaves) {
+    // new l = 1 entries may make more symbols candidates
+    delete_table2d<bool>(starts_table, n);
+    delete_table2d<bool>(ends_table, n);
+    starts_table = nullptr;
+    ends_table = nullptr;
+    prepare();
+  }
+
+  std::vector<bool> affected = grammar.dependents(changed);
+  std::vector<int> nts;
+  for (int nt = 1; nt < n; ++nt) {
+    if (affected[nt]) {
+      nts.push_back(nt);
+    }
+  }
+  std::set<std::tuple<int, int, int> > pinned;
+  for (size_t p = 0; p < pins.size(); p += 3) {
+    if (affected[pins[p]]) {
+      pinned.insert(std::make_tuple(pins[p], pins[p+1], pins[p+2]));
+    }
+  }
+  for (int l = 2; l < lmax; ++l) {
+    for (int i = 0; i <= m-l; ++i) {
+      if (!(dirty[i][l] || dirty[i][l-1] || dirty[i+1][l-1])) {
+        continue;
+      }
+      dirty[i][l] = true;
+      for (int nt : nts) {
+        own_row(nt, i);
+        cyk_table[nt][i][l] = pinned.count(std::make_tuple(nt, i, l)) ? S::one() : S::zero();
+        if (class_table) {
+          class_table[nt][i][l] = 0;
+        }
+        if (is_candidate(nt, i, l)) {
+          compute(nt, i, l);
+        } else {
+          cyk_table[nt][i][l] = S::zero();
+        }
+      }
+    }
+  }
+  delete_table2d<bool>(dirty, m);
+}
+
+/* A content hash of everything a parse depends on besides the grammar: the entries set for l = 1 (the tokens), the
+   pins, the ignored symbols (which the coloring depends on), and the table's bounds, also appended to words if set. It
+   does not change when parsing, so it can be taken before or after. */
+template<typename S>
+uint64_t BasicCYK<S>::fingerprint(std::vector<int> *words) {
+  Fingerprint f(words);
+  f.add(m);
+  f.add(lmax);
+  for (int nt = 1; nt < n; ++nt) {
+    for (int i = 0; i < m; ++i) {
+      if (!(cyk_table[nt][i][1] == S::zero())) {
+        f.add(nt);
+        f.add(i);
+      }
+    }
+  }
+  f.add(-1);
+  for (int x : pins) {
+    f.add(x);
+  }
+  f.add(-1);
+  for (int nt : ignored) {
+    f.add(nt);
+  }
+  return f.hash;
+}
+
+static const int SNAPSHOT_VERSION = 1;
+static const int SNAPSHOT_CLASSES = 1;
+static const int SNAPSHOT_COLORS = 2;
+
+/* Serialize the table, which must be parsed (but not lazily), into out, replacing its contents:
+
+     header    VERSION n m lmax flags R      flags: SNAPSHOT_CLASSES, SNAPSHOT_COLORS
+     rows      R times: nt i k, then k times: l [value] [classes]
+     coloring  for each span (i, l) with l < lmax, by l then i: coverage largest num size, then size times: nt i l
+
+   Only rows with non-zero entries, and only their non-zero entries, are written. Values are written as their bits,
+   except in the boolean semiring, where every non-zero entry is S::one(). The coloring is only written if colors is
+   set, and is only meaningful once the table has been colorized. Returns false (leaving out empty) if the table is
+   not parsed. */
+template<typename S>
+bool BasicCYK<S>::export_packed(PackedBuffer &out, bool colors) {
+  TRACE_SCOPE("export-packed");
+  out.clear();
+  if (!starts_table || known_table || resume_l < lmax) {
+    return false;
+  }
+  const bool values = !std::is_same<value_type, bool>::value;
+  out.push(SNAPSHOT_VERSION);
+  out.push(n);
+  out.push(m);
+  out.push(lmax);
+  out.push((class_table ? SNAPSHOT_CLASSES : 0) | (colors ? SNAPSHOT_COLORS : 0));
+  int num_rows_at = out.size();
+  out.push(0);
+
+  int num_rows = 0;
+  for (int nt = 1; nt < n; ++nt) {
+    for (int i = 0; i < m; ++i) {
+      int num_at = -1;
+      for (int l = 1; l < lmax && i+l <= m; ++l) {
+        if (cyk_table[nt][i][l] == S::zero()) {
+          continue;
+        }
+        if (num_at < 0) {
+          out.push(nt);
+          out.push(i);
+          num_at = out.size();
+          out.push(0);
+          ++num_rows;
+        }
+        ++out.data[num_at];
+        out.push(l);
+        if (values) {
+          out.push(to_word(cyk_table[nt][i][l]));
+        }
+        if (class_table) {
+          out.push(class_table[nt][i][l]);
+        }
+      }
+    }
+  }
+  out.data[num_rows_at] = num_rows;
+
+  if (colors) {
+    for (int l = 1; l < lmax; ++l) {
+      for (int i = 0; i <= m-l; ++i) {
+        Score &score = score_table[i][l];
+        ColorSet &cs = col_table[i][l];
+        out.push(score.coverage);
+        out.push(score.largest);
+        out.push(score.num);
+        out.push(cs.size());
+        for (size_t k = 0; k < cs.size(); ++k) {
+          out.push(cs.nts[k]);
+          out.push(cs.is[k]);
+          out.push(cs.ls[k]);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/* Restore a table serialized by export_packed, in place of parse (and of colorize, if the snapshot has colors). The
+   table must not be parsed yet and must match the snapshot's length, bounds and filtering, and have a row for every
+   symbol in it, though it may have more (e.g., for symbols interned since the snapshot was taken); its own entries are
+   replaced, so the snapshot should be of a table with the same fingerprint (see ParseCache). Returns false, leaving the
+   table as it was, if the snapshot does not fit or is malformed. */
+template<typename S>
+bool BasicCYK<S>::load_packed(PackedBuffer &in) {
+  TRACE_SCOPE("load-packed");
+  const int *p = in.ptr();
+  const int *end = p + in.size();
+  if (starts_table || known_table || borrowed || end - p < 6) {
+    return false;
+  }
+  int flags = p[4];
+  if (p[0] != SNAPSHOT_VERSION || p[1] > n || p[2] != m || p[3] != lmax ||
+      ((flags & SNAPSHOT_CLASSES) != 0) != (class_table != nullptr)) {
     return false;
   }
+  const bool values = !std::is_same<value_type, bool>::value;
+  const int width = 1 + values + (class_table != nullptr); // ints per entry
+  int num_rows = p[5];
+  p += 6;
 
-  int **ps = grammar.productions_with_lhs(nt);
-  for (int j = 0; j < grammar.m; ++j) {
-    int *p = ps[j];
-    // check for end sentinel
-    if (p[0] == 0) {
-      break;
+  // check the layout before writing anything
+  const int *rows = p;
+  for (int r = 0; r < num_rows; ++r) {
+    if (end - p < 3 || p[0] < 1 || p[0] >= n || p[1] < 0 || p[1] >= m || p[2] < 0 || (end - p - 3) / width < p[2]) {
+      return false;
+    }
+    int i = p[1], k = p[2];
+    p += 3;
+    for (int e = 0; e < k; ++e, p += width) {
+      if (p[0] < 1 || p[0] >= lmax || i + p[0] > m) {
+        return false;
+      }
+    }
+  }
+  const int *coloring = p;
+  if (flags & SNAPSHOT_COLORS) {
+    for (int l = 1; l < lmax; ++l) {
+      for (int i = 0; i <= m-l; ++i) {
+        if (end - p < 4 || p[3] < 0 || (end - p - 4) / 3 < p[3]) {
+          return false;
+        }
+        p += 4 + 3 * p[3];
+      }
     }
+  }
 
-    // this is a binary rule nt -> a b
-    int a = p[1];
-    int b = p[2];
-    for (int k = 1; k < l; ++k) {
-      bool prefix = cyk_table[a][i][k];
-      bool suffix = cyk_table[b][i+k][l-k];
-      bool match = prefix && suffix;
-      if (match) {
+  for (int nt = 1; nt < n; ++nt) {
+    for (int i = 0; i < m; ++i) {
+      std::fill(cyk_table[nt][i], cyk_table[nt][i] + lmax, S::zero());
+      if (class_table) {
+        std::fill(class_table[nt][i], class_table[nt][i] + lmax, 0);
+      }
+    }
+  }
+  p = rows;
+  for (int r = 0; r < num_rows; ++r) {
+    int nt = p[0], i = p[1], k = p[2];
+    p += 3;
+    for (int e = 0; e < k; ++e, p += width) {
+      int l = p[0];
+      cyk_table[nt][i][l] = values ? from_word<value_type>(p[1]) : S::one();
+      if (class_table) {
+        class_table[nt][i][l] = p[width-1];
+      }
+    }
+  }
+  prepare();
+  resume_l = lmax;
+  interrupted = false;
+
+  if (flags & SNAPSHOT_COLORS) {
+    p = coloring;
+    for (int l = 1; l < lmax; ++l) {
+      for (int i = 0; i <= m-l; ++i) {
+        score_table[i][l] = Score(p[0], p[1], p[2]);
+        ColorSet &cs = col_table[i][l];
+        cs = ColorSet();
+        for (int k = 0; k < p[3]; ++k) {
+          cs.add(p[4 + 3*k], p[5 + 3*k], p[6 + 3*k]);
+        }
+        p += 4 + 3 * p[3];
+      }
+    }
+    if (lmax <= m) {
+      colorize_bounded();
+    }
+  }
+  DEBUG_PRINT(("load_packed: %d rows\n", num_rows));
+  return true;
+}
+
+template<typename S>
+bool BasicCYK<S>::is_known(int nt, int i, int l) {
+  return l == 1 || known_table[nt][i][l];
+}
+
+template<typename S>
+void BasicCYK<S>::compute(int nt, int i, int l) {
+  if (known_table) {
+    if (known_table[nt][i][l]) {
+      return;
+    }
+    known_table[nt][i][l] = true;
+  }
+  cyk_table[nt][i][l] = match(nt, i, l);
+  if (!(cyk_table[nt][i][l] == S::zero())) {
+    STAT_INC(CELLS_SET);
+  }
+}
+
+/* Compute an unknown entry, and whichever unknown entries it depends on, with an explicit stack of goals rather than
+   recursion, since derivations can nest as deeply as the input is long. */
+template<typename S>
+void BasicCYK<S>::evaluate(int nt, int i, int l) {
+  if (!push_goal(nt, i, l)) {
+    return;
+  }
+  while (!goals.empty()) {
+    Goal &g = goals.back();
+    int child_nt, child_i, child_l;
+    if (advance(g, child_nt, child_i, child_l)) {
+      if (!(g.acc == S::zero())) {
+        STAT_INC(CELLS_SET);
+      }
+      cyk_table[g.nt][g.i][g.l] = g.acc;
+      if (class_table) {
+        class_table[g.nt][g.i][g.l] = g.classes;
+      }
+      known_table[g.nt][g.i][g.l] = true;
+      goals.pop_back();
+    } else {
+      // invalidates g
+      push_goal(child_nt, child_i, child_l);
+    }
+  }
+}
+
+/* Start searching for derivations of an unknown entry. Return false if the entry was settled right away instead: it is
+   pinned (see match), or its symbol is not a candidate for it (see prepare). */
+template<typename S>
+bool BasicCYK<S>::push_goal(int nt, int i, int l) {
+  if (!(cyk_table[nt][i][l] == S::zero()) || !is_candidate(nt, i, l)) {
+    cyk_table[nt][i][l] = S::zero();
+    if (class_table) {
+      class_table[nt][i][l] = 0;
+    }
+    known_table[nt][i][l] = true;
+    return false;
+  }
+  STAT_INC(MATCH_CALLS);
+  Goal g = {nt, i, l, 0, 1, S::zero(), 0};
+  goals.push_back(g);
+  return true;
+}
+
+/* Continue the search for derivations of g, in the same order as match. Return true once the entry is final, otherwise
+   return false with (nt, i, l) set to the unknown entry that the search needs next. */
+template<typename S>
+bool BasicCYK<S>::advance(Goal &g, int &nt, int &i, int &l) {
+  int **ps = grammar.productions_with_lhs(g.nt);
+  for (; g.j < grammar.m && ps[g.j][0] != 0; ++g.j, g.k = 1) {
+    int a = ps[g.j][1];
+    int b = ps[g.j][2];
+    for (; g.k < g.l; ++g.k) {
+      if (!is_known(a, g.i, g.k)) {
+        nt = a; i = g.i; l = g.k;
+        return false;
+      }
+      if (cyk_table[a][g.i][g.k] == S::zero()) {
+        continue;
+      }
+      if (!is_known(b, g.i+g.k, g.l-g.k)) {
+        nt = b; i = g.i+g.k; l = g.l-g.k;
+        return false;
+      }
+      if (derive(g.nt, g.j, g.i, g.k, g.l, g.acc, g.classes)) {
         return true;
       }
     }
   }
-  return false;
+  return true;
+}
+
+template<typename S>
+typename BasicCYK<S>::value_type BasicCYK<S>::match(int nt, int i, int l) {
+  // an initially non-zero value is treated specially to mean "this entry is pinned to zero"
+  if (!(cyk_table[nt][i][l] == S::zero())) {
+    return S::zero();
+  }
+
+  STAT_INC(MATCH_CALLS);
+  value_type acc = S::zero();
+  Grammar::class_mask classes = 0;
+  bool done = false;
+
+  int **ps = grammar.productions_with_lhs(nt);
+  for (int j = 0; j < grammar.m && !done; ++j) {
+    // check for end sentinel
+    if (ps[j][0] == 0) {
+      break;
+    }
+    for (int k = 1; k < l && !done; ++k) {
+      done = derive(nt, j, i, k, l, acc, classes);
+    }
+  }
+  if (class_table) {
+    class_table[nt][i][l] = classes;
+  }
+  return acc;
+}
+
+/* Add the derivation of (nt, i, l) by the jth production of nt, split at k, to acc. If the grammar is filtered, the
+   derivation is skipped when its first or last child can only be derived by classes of productions that the rule's
+   child filter forbids, and otherwise adds its class to classes. Return true iff no further derivation can change the
+   entry: acc is saturated and, if filtered, classes contains class 0, which a parent's filter never rejects. */
+template<typename S>
+bool BasicCYK<S>::derive(int nt, int j, int i, int k, int l, value_type &acc, Grammar::class_mask &classes) {
+  STAT_INC(SPLIT_POINTS);
+  // this is a binary rule nt -> a b
+  int *p = grammar.productions_with_lhs(nt)[j];
+  int a = p[1];
+  int b = p[2];
+  value_type v = S::times(S::weight(grammar.weights[nt][j]), S::times(cyk_table[a][i][k], cyk_table[b][i+k][l-k]));
+  if (!class_table) {
+    acc = S::plus(acc, v);
+    return S::saturated(acc);
+  }
+
+  if (v == S::zero()) {
+    return false;
+  }
+  const Grammar::ChildFilter &filter = grammar.child_filters[grammar.filters[nt][j]];
+  Grammar::class_mask first = class_table[a][i][k];
+  Grammar::class_mask last = class_table[b][i+k][l-k];
+  if (!(first & ~filter.first) || !(last & ~filter.last)) {
+    return false;
+  }
+  int cls = grammar.classes[nt][j];
+  acc = S::plus(acc, v);
+  classes |= cls == Grammar::FIRST_CHILD ? first : 1u << cls;
+  return S::saturated(acc) && (classes & 1);
 }
 
-ColorSet & CYK::get_colors(int i, int l) {
+template<typename S>
+ColorSet & BasicCYK<S>::get_colors(int i, int l) {
+  if (l >= lmax) {
+    return i == 0 && l == m ? full_colors : no_colors;
+  }
   return col_table[i][l];
 }
 
-void CYK::set_color(int i, int l, int nt, int ci, int cl) {
+/* Append the colors of colors to out as [nt i l] triples. */
+void append_colors(PackedBuffer &out, ColorSet &colors) {
+  for (size_t k = 0; k < colors.size(); ++k) {
+    out.push(colors.nts[k]);
+    out.push(colors.is[k]);
+    out.push(colors.ls[k]);
+  }
+}
+
+/* The export_ functions replace the contents of out with their results in one call, so JS can read them through a
+   view of the buffer (see PackedBuffer) rather than with an embind call per element. */
+template<typename S>
+void BasicCYK<S>::export_colors(int i, int l, PackedBuffer &out) {
+  out.clear();
+  append_colors(out, get_colors(i, l));
+}
+
+template<typename S>
+void BasicCYK<S>::export_symbols(int i, int l, PackedBuffer &out) {
+  out.clear();
+  for (int nt = 1; nt < n; ++nt) {
+    if (get_cyk(nt, i, l)) {
+      out.push(nt);
+    }
+  }
+}
+
+/* Entries are ordered by l, then i, then nt. In lazy mode, this evaluates every entry within the span. */
+template<typename S>
+void BasicCYK<S>::export_chart(int i, int l, PackedBuffer &out) {
+  out.clear();
+  for (int l2 = 1; l2 <= l && l2 < lmax; ++l2) {
+    for (int i2 = i; i2+l2 <= i+l; ++i2) {
+      for (int nt = 1; nt < n; ++nt) {
+        if (get_cyk(nt, i2, l2)) {
+          out.push(nt);
+          out.push(i2);
+          out.push(l2);
+        }
+      }
+    }
+  }
+}
+
+template<typename S>
+void BasicCYK<S>::set_color(int i, int l, int nt, int ci, int cl) {
   DEBUG_PRINT(("%20s i=%d l=%d [%d %d %d]\n", "set_color", i, l, nt, ci, cl));
   col_table[i][l].add(nt, ci, cl);
 }
 
-void CYK::set_colors(int i, int l, ColorSet &colors) {
+template<typename S>
+void BasicCYK<S>::set_colors(int i, int l, ColorSet &colors) {
   DEBUG_PRINT(("%20s i=%d l=%d num=%d\n", "set_colors", i, l, colors.size()));
-  for (int j = 0; j < colors.size(); ++j) {
+  for (int j = 0; j < (int)colors.size(); ++j) {
     set_color(i, l, colors.nt(j), colors.i(j), colors.l(j));
   }
 }
 
-void CYK::ignore(int nt) {
+template<typename S>
+void BasicCYK<S>::ignore(int nt) {
   ignored.insert(nt);
 }
 
-bool CYK::is_ignored(int nt) {
+template<typename S>
+bool BasicCYK<S>::is_ignored(int nt) {
   return ignored.find(nt) != ignored.end();
 }
 
-Score & CYK::get_score(int i, int l) {
+template<typename S>
+void BasicCYK<S>::set_cancel_token(CancelToken *token) {
+  cancel_token = token;
+}
+
+template<typename S>
+bool BasicCYK<S>::is_cancelled() {
+  return cancelled;
+}
+
+template<typename S>
+bool BasicCYK<S>::poll_cancel() {
+  if (cancel_token && cancel_token->cancelled()) {
+    cancelled = true;
+  }
+  return cancelled;
+}
+
+template<typename S>
+Score & BasicCYK<S>::get_score(int i, int l) {
   return score_table[i][l];
 }
 
-void CYK::set_score(int i, int l, int coverage, int largest, int num) {
+template<typename S>
+void BasicCYK<S>::set_score(int i, int l, int coverage, int largest, int num) {
   score_table[i][l].coverage = coverage;
   score_table[i][l].largest = largest;
   score_table[i][l].num = num;
 }
 
-void CYK::compute_color(int i, int l) {
+template<typename S>
+void BasicCYK<S>::compute_color(int i, int l) {
 
   DEBUG_PRINT(("compute_color i=%d l=%d\n", i, l));
+  STAT_INC(COLOR_CELLS);
 
   // compute set of non-ignored nts that cover entire range
   std::vector<int> nts;
@@ -337,6 +1504,7 @@ void CYK::compute_color(int i, int l) {
           best.push_back(&rcolors);
       } else if (combined.equals(score_so_far)) {
         DEBUG_PRINT(("same"));
+        STAT_INC(COLOR_TIES);
         if (lcolors.size() > 0)
           best.push_back(&lcolors);
         if (rcolors.size() > 0)
@@ -356,29 +1524,44 @@ void CYK::compute_color(int i, int l) {
   }
 }
 
-void CYK::colorize() {
-  // populate color_table and score_table with initial sets for l = 1
-  DEBUG_PRINT(("init\n"));
-  for (int i = 0; i < m; ++i) {
-    for (int nt = 1; nt < n; ++nt) {
-      if (!is_ignored(nt) && get_cyk(nt, i, 1)) {
-        set_color(i, 1, nt, i, 1);
-        set_score(i, 1, 1, 1, -1);
+template<typename S>
+void BasicCYK<S>::colorize() {
+  TRACE_SCOPE("colorize");
+  cancelled = false;
+  if (resume_color_l == 0) {
+    // populate color_table and score_table with initial sets for l = 1
+    DEBUG_PRINT(("init\n"));
+    for (int i = 0; i < m; ++i) {
+      for (int nt = 1; nt < n; ++nt) {
+        if (!is_ignored(nt) && get_cyk(nt, i, 1)) {
+          set_color(i, 1, nt, i, 1);
+          set_score(i, 1, 1, 1, -1);
+        }
       }
     }
+    resume_color_l = 2;
   }
 
-  // now compute colors for spans with l > 1
+  // now compute colors for spans with l > 1, stopping at a diagonal boundary if cancelled
   DEBUG_PRINT(("colorize\n"));
-  for (int l = 2; l < lmax; ++l) {
-    for (int i = 0; i <= m-l; ++i) {
-      compute_color(i, l);
+  for (; resume_color_l < lmax; ++resume_color_l) {
+    if (poll_cancel()) {
+      return;
+    }
+    for (int i = 0; i <= m-resume_color_l; ++i) {
+      compute_color(i, resume_color_l);
     }
   }
+  resume_color_l = 0;
+  if (lmax <= m) {
+    colorize_bounded();
+  }
 }
 
 /* Call this first before performing colorize_partial.  This initializes the coloring table for l=1. */
-void CYK::init_colorize_partial() {
+template<typename S>
+void BasicCYK<S>::init_colorize_partial() {
+  TRACE_SCOPE("init-colorize-partial");
   // populate color_table and score_table with initial sets for l = 1
   DEBUG_PRINT(("init\n"));
   for (int i = 0; i < m; ++i) {
@@ -392,7 +1575,9 @@ void CYK::init_colorize_partial() {
 }
 
 /* Analogous to parse_partial, but for coloring. */
-int CYK::colorize_partial(int l) {
+template<typename S>
+int BasicCYK<S>::colorize_partial(int l) {
+  TRACE_SCOPE_ARG("colorize-partial", "l", l);
   // now compute colors for spans with l > 1
   DEBUG_PRINT(("colorize\n"));
   int next_l = l + 10;
@@ -403,13 +1588,106 @@ int CYK::colorize_partial(int l) {
   }
 
   if (l == lmax) {
+    if (lmax <= m) {
+      colorize_bounded();
+    }
     return 0;
   } else {
     return next_l;
   }
 }
 
-void CYK::print_cyk() {
+/* In bounded mode, compute full_colors, the coloring of the whole input, from the colorings of spans of up to max_span
+   tokens. This extends compute_color from two parts to any number: the best score of each prefix of the input is the
+   best combination of a shorter prefix and one more bounded span, and the coloring is the union of the colorings of
+   the spans along every best sequence. */
+template<typename S>
+void BasicCYK<S>::colorize_bounded() {
+  TRACE_SCOPE("colorize-bounded");
+  std::vector<Score> best(m+1);
+  std::vector<std::vector<int> > best_splits(m+1); // best_splits[e]: ends of the best prefixes that lead to prefix e
+  for (int e = 1; e <= m; ++e) {
+    Score score_so_far(0,0,-1000000);
+    for (int s = std::max(0, e-(lmax-1)); s < e; ++s) {
+      Score &span = get_score(s, e-s);
+      Score combined(best[s].coverage + span.coverage,
+                     std::max(best[s].largest, span.largest),
+                     best[s].num + span.num);
+      if (combined.better_than(score_so_far)) {
+        score_so_far = combined;
+        best_splits[e].clear();
+        best_splits[e].push_back(s);
+      } else if (combined.equals(score_so_far)) {
+        best_splits[e].push_back(s);
+      }
+    }
+    best[e] = score_so_far;
+  }
+  DEBUG_PRINT(("colorize_bounded: coverage=%d\n", best[m].coverage));
+
+  full_colors = ColorSet();
+  std::vector<bool> seen(m+1);
+  std::vector<int> ends(1, m);
+  while (!ends.empty()) {
+    int e = ends.back();
+    ends.pop_back();
+    for (int s : best_splits[e]) {
+      ColorSet &colors = get_colors(s, e-s);
+      for (size_t c = 0; c < colors.size(); ++c) {
+        full_colors.add(colors.nt(c), colors.i(c), colors.l(c));
+      }
+      if (!seen[s]) {
+        seen[s] = true;
+        ends.push_back(s);
+      }
+    }
+  }
+}
+
+/* Refresh a colored table after reparse. The coloring of a span only depends on the entries of the spans it contains,
+   so only the colorings of spans that contain a span recorded by reparse are recomputed. */
+template<typename S>
+void BasicCYK<S>::recolorize() {
+  if (!dirty_table) {
+    return;
+  }
+  TRACE_SCOPE("recolorize");
+  bool any = false;
+  for (int i = 0; i < m; ++i) {
+    if (!dirty_table[i][1]) {
+      continue;
+    }
+    any = true;
+    col_table[i][1] = ColorSet();
+    score_table[i][1] = Score();
+    for (int nt = 1; nt < n; ++nt) {
+      if (!is_ignored(nt) && get_cyk(nt, i, 1)) {
+        set_color(i, 1, nt, i, 1);
+        set_score(i, 1, 1, 1, -1);
+      }
+    }
+  }
+  for (int l = 2; l < lmax; ++l) {
+    for (int i = 0; i <= m-l; ++i) {
+      bool &dirty = dirty_table[i][l];
+      dirty = dirty || dirty_table[i][l-1] || dirty_table[i+1][l-1];
+      if (dirty) {
+        any = true;
+        col_table[i][l] = ColorSet();
+        score_table[i][l] = Score();
+        compute_color(i, l);
+      }
+    }
+  }
+  if (any && lmax <= m) {
+    colorize_bounded();
+  }
+  delete_table2d<bool>(dirty_table, m);
+  dirty_table = nullptr;
+}
+
+template<typename S>
+void BasicCYK<S>::print_cyk() {
   printf("Printing CYK table [n = %d, m = %d]\n", n, m);
   for (int nt = 0; nt < n; ++nt) {
     printf("=== %d ===\n", nt);
@@ -421,21 +1699,22 @@ void CYK::print_cyk() {
     for (int i = 0; i < m; ++i) {
       printf("i=%d | ", i);
       for (int l = 0; l < lmax; ++l) {
-        printf("%d ", cyk_table[nt][i][l]);
+        printf("%d ", get_cyk(nt, i, l));
       }
       printf("\n");
     }
   }
 }
 
-void CYK::print_col() {
+template<typename S>
+void BasicCYK<S>::print_col() {
   printf("Printing Color table [n = %d, m = %d]\n", n, m);
   for (int l = 0; l < lmax; ++l) {
     for (int i = 0; i < m; ++i) {
       ColorSet &cs = col_table[i][l];
       if (cs.size() > 0) {
         printf("%d %d | ", i, l);
-        for (int j = 0; j < cs.size(); ++j) {
+        for (int j = 0; j < (int)cs.size(); ++j) {
           printf("[%d %d %d] ", cs.nt(j), cs.i(j), cs.l(j));
         }
         printf("\n");
@@ -444,7 +1723,250 @@ void CYK::print_col() {
   }
 }
 
-void CYK::print_info() {
+template<typename S>
+void BasicCYK<S>::print_info() {
   printf("n = %d\nm = %d\nlmax = %d\n", n, m, lmax);
-  printf("Ignored (%d)\n", ignored.size());
+  printf("Ignored (%d)\n", (int)ignored.size());
+}
+
+template class BasicCYK<BooleanSemiring>;
+template class BasicCYK<CountingSemiring>;
+template class BasicCYK<MaxScoreSemiring>;
+
+////////////////////////////////////////////////////////////////////////////////
+// Segmented CYK
+////////////////////////////////////////////////////////////////////////////////
+
+/* Segment boundaries are taken from segment_starts, in increasing order; 0 and positions outside the string are
+   ignored. Segments are parsed on up to num_threads threads, or default_num_threads() if it is not positive. */
+SegmentedCYK::SegmentedCYK(int m, Grammar &g, std::vector<int> &segment_starts, int num_threads):
+  n(g.n), m(m), num_threads(num_threads), whole(nullptr), grammar(g), cancel_token(nullptr), cancelled(false) {
+  starts.push_back(0);
+  for (int s : segment_starts) {
+    if (s > starts.back() && s < m) {
+      starts.push_back(s);
+    }
+  }
+  starts.push_back(m);
+  for (size_t k = 0; k+1 < starts.size(); ++k) {
+    CYK *segment = new CYK(n, starts[k+1]-starts[k], grammar);
+    segment->owns_grammar = false;
+    segments.push_back(segment);
+  }
+}
+
+SegmentedCYK::~SegmentedCYK() {
+  for (CYK *segment : segments) {
+    delete segment;
+  }
+  delete whole;
+  delete &grammar; // see ~BasicCYK
+}
+
+int SegmentedCYK::segment_of(int i) {
+  return std::upper_bound(starts.begin(), starts.end(), i) - starts.begin() - 1;
+}
+
+void SegmentedCYK::set_cyk(int nt, int i, int l) {
+  sets.push_back(nt);
+  sets.push_back(i);
+  sets.push_back(l);
+  if (whole) {
+    whole->set_cyk(nt, i, l);
+    return;
+  }
+  if (i < 0 || l < 1 || i+l > m) {
+    return;
+  }
+  int k = segment_of(i);
+  if (i+l <= starts[k+1]) {
+    segments[k]->set_cyk(nt, i-starts[k], l);
+  }
+}
+
+bool SegmentedCYK::get_cyk(int nt, int i, int l) {
+  if (whole) {
+    return whole->get_cyk(nt, i, l);
+  }
+  if (i < 0 || l < 1 || i+l > m) {
+    return false;
+  }
+  int k = segment_of(i);
+  return i+l <= starts[k+1] && segments[k]->get_cyk(nt, i-starts[k], l);
+}
+
+void SegmentedCYK::ignore(int nt) {
+  ignored.insert(nt);
+  for (CYK *segment : segments) {
+    segment->ignore(nt);
+  }
+  if (whole) {
+    whole->ignore(nt);
+  }
+}
+
+bool SegmentedCYK::stitch() {
+  for (size_t k = 0; k < segments.size(); ++k) {
+    int l = starts[k+1]-starts[k];
+    bool derived = false;
+    for (int nt = 1; nt < n && !derived; ++nt) {
+      derived = !ignored.count(nt) && segments[k]->get_cyk(nt, 0, l);
+    }
+    if (!derived) {
+      DEBUG_PRINT(("stitch: segment %d (%d %d) is not derived\n", (int)k, starts[k], l));
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Parse every segment, then fall back to a whole-string parse if some segment is not derived in full. With a cancel
+   token, segments that have not started when it is cancelled are skipped, and those that are running stop at their
+   next diagonal; stitching waits until a later call has parsed every segment. */
+bool SegmentedCYK::parse() {
+  cancelled = false;
+  if (whole) {
+    whole->parse();
+    cancelled = whole->is_cancelled();
+    return false;
+  }
+  // the segments share the grammar, so analyze it before they run concurrently
+  grammar.analyze();
+  std::vector<char> skipped(segments.size(), 0);
+  parallel_for(segments.size(), num_threads, [&](int k) {
+    if (cancel_token && cancel_token->cancelled()) {
+      skipped[k] = 1;
+      return;
+    }
+    TRACE_SCOPE_ARG("parse-segment", "segment", k);
+    segments[k]->parse();
+  });
+  for (size_t k = 0; k < segments.size(); ++k) {
+    cancelled = cancelled || skipped[k] || segments[k]->is_cancelled();
+  }
+  if (cancelled) {
+    return true;
+  }
+  if (stitch()) {
+    return true;
+  }
+
+  whole = new CYK(n, m, grammar);
+  whole->owns_grammar = false;
+  whole->set_cancel_token(cancel_token);
+  for (int nt : ignored) {
+    whole->ignore(nt);
+  }
+  for (size_t p = 0; p < sets.size(); p += 3) {
+    whole->set_cyk(sets[p], sets[p+1], sets[p+2]);
+  }
+  for (CYK *segment : segments) {
+    delete segment;
+  }
+  segments.clear();
+  whole->parse();
+  cancelled = whole->is_cancelled();
+  return false;
+}
+
+/* Color every segment; cancellation works as in parse. */
+void SegmentedCYK::colorize() {
+  cancelled = false;
+  if (whole) {
+    whole->colorize();
+    cancelled = whole->is_cancelled();
+    return;
+  }
+  std::vector<char> skipped(segments.size(), 0);
+  parallel_for(segments.size(), num_threads, [&](int k) {
+    if (cancel_token && cancel_token->cancelled()) {
+      skipped[k] = 1;
+      return;
+    }
+    TRACE_SCOPE_ARG("colorize-segment", "segment", k);
+    segments[k]->colorize();
+  });
+  for (size_t k = 0; k < segments.size(); ++k) {
+    cancelled = cancelled || skipped[k] || segments[k]->is_cancelled();
+  }
+}
+
+/* Append the colors of a segment, moved to start at offset. Colors of different segments are disjoint, so this skips
+   ColorSet::add's duplicate check. */
+static void append_shifted(ColorSet &result, ColorSet &colors, int offset) {
+  for (size_t c = 0; c < colors.size(); ++c) {
+    result.nts.push_back(colors.nt(c));
+    result.is.push_back(colors.i(c)+offset);
+    result.ls.push_back(colors.l(c));
+  }
+}
+
+/* Colors of a span within one segment, or the union of the colors of the segments that make up a span. */
+ColorSet SegmentedCYK::get_colors(int i, int l) {
+  if (whole) {
+    return whole->get_colors(i, l);
+  }
+  ColorSet result;
+  if (i < 0 || l < 1 || i+l > m) {
+    return result;
+  }
+  int k = segment_of(i);
+  if (i+l <= starts[k+1]) {
+    append_shifted(result, segments[k]->get_colors(i-starts[k], l), starts[k]);
+  } else if (i == starts[k] && std::binary_search(starts.begin(), starts.end(), i+l)) {
+    for (; starts[k] < i+l; ++k) {
+      append_shifted(result, segments[k]->get_colors(0, starts[k+1]-starts[k]), starts[k]);
+    }
+  }
+  return result;
+}
+
+void SegmentedCYK::export_colors(int i, int l, PackedBuffer &out) {
+  out.clear();
+  ColorSet colors = get_colors(i, l);
+  append_colors(out, colors);
+}
+
+int SegmentedCYK::get_num_segments() {
+  return whole ? 1 : segments.size();
+}
+
+bool SegmentedCYK::is_stitched() {
+  return !whole;
+}
+
+void SegmentedCYK::set_cancel_token(CancelToken *token) {
+  cancel_token = token;
+  for (CYK *segment : segments) {
+    segment->set_cancel_token(token);
+  }
+  if (whole) {
+    whole->set_cancel_token(token);
+  }
+}
+
+bool SegmentedCYK::is_cancelled() {
+  return cancelled;
+}
+
+/* Write every span with more than one derivation as [nt i l count] quadruples, counts clamped to the largest int. */
+void export_ambiguous_spans(CountingCYK &cyk, PackedBuffer &out) {
+  out.clear();
+  const int max_count = std::numeric_limits<int>::max();
+  const int n = cyk.get_n();
+  const int lmax = cyk.get_lmax();
+  const int m = cyk.get_m();
+  for (int l = 1; l < lmax; ++l) {
+    for (int nt = 1; nt < n; ++nt) {
+      for (int i = 0; i <= m-l; ++i) {
+        CountingCYK::value_type count = cyk.get_value(nt, i, l);
+        if (count > 1) {
+          out.push(nt);
+          out.push(i);
+          out.push(l);
+          out.push(count > (CountingCYK::value_type)max_count ? max_count : (int)count);
+        }
+      }
+    }
+  }
 }
@@ -1,8 +1,15 @@
 #ifndef _parser_h
 #define _parser_h
 
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <ostream>
 #include <vector>
 #include <set>
+#include "cancel.h"
+#include "packed.h"
+#include "symbols.h"
 
 /** We store the grammar in an N by M by 3 table, where N is the number of symbols,
     and M is the maximum number of productions for a given LHS.
@@ -11,17 +18,49 @@
     by direct injection into the corresponding CYK table).
 */
 class Grammar {
+
+  int append(int l, int r1, int r2);
+
 public:
 
-  int n;        // number of symbols
-  int m;        // max number of productions per LHS
-  int ***table; // the grammar table
+  /** Associativity and priority filters are enforced on the first and last child of a rule, in terms of the classes
+      of source productions that derived the children. Class 0 stands for every unfiltered production (and tokens), so
+      it is never forbidden. A rule of an intermediate (binarized) symbol has class FIRST_CHILD: the classes of its
+      first child are passed up to the rule whose first child it is. */
+  typedef unsigned int class_mask;
+  static const int MAX_CLASSES = 31;
+  static const int FIRST_CHILD = -1;
+
+  struct ChildFilter {
+    class_mask first; // classes forbidden as the first child
+    class_mask last;  // classes forbidden as the last child
+  };
+
+  int n;           // number of symbols
+  int m;           // max number of productions per LHS
+  int ***table;    // the grammar table
+  float **weights; // weights[l][j] is the weight of the jth production of l, used by MaxScoreSemiring
+  int **filters;   // filters[l][j] indexes child_filters for the jth production of l; 0 forbids nothing
+  int **classes;   // classes[l][j] is the class the jth production of l derives, or FIRST_CHILD
+  std::vector<ChildFilter> child_filters;
+  bool filtered;   // true iff some rule was added with add_filtered
+  std::vector<std::vector<int> > left_closure;  // left_closure[x]: x and every symbol with a derivation starting with x
+  std::vector<std::vector<int> > right_closure; // right_closure[x]: x and every symbol with a derivation ending with x
 
   Grammar(int n, int m);
+  Grammar(SymbolTable &symbols, int m);
   ~Grammar();
 
   void add(int l, int r1, int r2);
+  void add_weighted(int l, int r1, int r2, float weight);
+  int add_child_filter(int first, int last);
+  void add_filtered(int l, int r1, int r2, int filter, int cls);
   int** productions_with_lhs(int l);
+  void analyze();
+  bool same_productions(Grammar &other, int l);
+  std::vector<bool> dependents(const std::vector<bool> &changed);
+  void swap(Grammar &other);
+  uint64_t fingerprint(std::vector<int> *words = nullptr);
   void print();
 
 };
@@ -58,45 +97,217 @@ public:
   friend std::ostream & operator<<(std::ostream &strm, const Score &s);
 };
 
-class CYK {
+/** Semirings for BasicCYK. Each provides the value type of a CYK table entry, zero() (no derivation), one() (a token),
+    weight() (the value of applying a rule with the given weight), plus() (alternative derivations), times() (combining
+    the two halves of a binary rule), and saturated(), which holds for values that plus() can no longer change, so the
+    recognizer can stop early. */
+struct BooleanSemiring {
+  typedef bool value_type;
+
+  static bool zero() { return false; }
+  static bool one() { return true; }
+  static bool weight(float) { return true; }
+  static bool plus(bool a, bool b) { return a || b; }
+  static bool times(bool a, bool b) { return a && b; }
+  static bool saturated(bool a) { return a; }
+};
+
+/** Number of derivations, saturating at the largest unsigned int. */
+struct CountingSemiring {
+  typedef unsigned int value_type;
+
+  static value_type zero() { return 0; }
+  static value_type one() { return 1; }
+  static value_type weight(float) { return 1; }
+  static value_type plus(value_type a, value_type b) {
+    return a > std::numeric_limits<value_type>::max() - b ? std::numeric_limits<value_type>::max() : a + b;
+  }
+  static value_type times(value_type a, value_type b) {
+    if (a == 0 || b == 0) {
+      return 0;
+    }
+    return a > std::numeric_limits<value_type>::max() / b ? std::numeric_limits<value_type>::max() : a * b;
+  }
+  static bool saturated(value_type a) { return a == std::numeric_limits<value_type>::max(); }
+};
+
+/** Score of the best derivation, where the score of a derivation is the sum of the weights of its binary rules (see
+    Grammar::add_weighted). */
+struct MaxScoreSemiring {
+  typedef float value_type;
+
+  static float zero() { return -std::numeric_limits<float>::infinity(); }
+  static float one() { return 0; }
+  static float weight(float w) { return w; }
+  static float plus(float a, float b) { return a > b ? a : b; }
+  static float times(float a, float b) { return a + b; }
+  static bool saturated(float) { return false; }
+};
+
+/** The CYK recognizer and colorizer, parameterized by the semiring of its table entries. Only the instantiations for
+    the semirings above exist (see the bottom of parser.cpp); CYK is the boolean recognizer used everywhere else. */
+class SegmentedCYK;
+class ParseCache;
+
+template<typename S>
+class BasicCYK {
+  friend class SegmentedCYK;
+  friend class ParseCache;
+
+public:
+
+  typedef typename S::value_type value_type;
+
 private:
 
-  int n;                 // 1 + number of symbols
-  int m;                 // length of token string
-  int lmax;              // 1+m
-  bool ***cyk_table;     // the CYK table
-  ColorSet **col_table;  // the coloring table
-  Score **score_table;   // the color score table
-  std::set<int> ignored; // set of ignored symbols
-  Grammar &grammar;      // A binary grammar in CNF form
+  int n;                   // 1 + number of symbols
+  int m;                   // length of token string
+  int lmax;                // 1+m, or 1+max_span in bounded mode
+  value_type ***cyk_table; // the CYK table
+  Grammar::class_mask ***class_table; // classes of the derivations of each entry, only if the grammar is filtered
+  bool ***known_table;     // entries that are final, only in lazy mode (see parse_lazy)
+  bool **starts_table;     // starts_table[nt][i]: some derivation of nt may start at token i (see prepare)
+  bool **ends_table;       // ends_table[nt][i]: some derivation of nt may end at token i (see prepare)
+  std::vector<bool> derivable;              // derivable[nt]: nt may derive an entry with l > 1 (see prepare)
+  std::vector<std::vector<int> > candidates; // candidates[i]: derivable symbols that may start at token i
+  std::vector<int> pins;   // (nt, i, l) triples of the entries pinned before parsing, see match
+  std::vector<int> touched;// (nt, i) pairs of the l = 1 entries changed after parsing, see reparse
+  bool **dirty_table;      // spans whose entries changed in the last reparse, see recolorize
+  bool **borrowed;         // forks only: borrowed[nt][i] iff row (nt, i) of cyk_table and class_table is the base's
+  std::vector<int> changes;// forks only: (nt, i, l) triples of the entries set or unset since the last parse
+  int resume_l;            // the next diagonal that parse computes, lmax once the table is parsed
+  int resume_color_l;      // the next diagonal that colorize colors after it was cancelled, otherwise 0
+  CancelToken *cancel_token; // polled by parse and colorize, if set (not owned)
+  bool cancelled;          // whether the last parse or colorize was cancelled
+  bool interrupted;        // whether parse was cancelled partway through the table, until a later call finishes it
+  bool pruning;            // whether prepare restricts entries to candidate symbols (see set_pruning)
 
-  bool match(int nt, int i, int l);                                    // compute one element of the CYK table
+  /** An entry whose derivations are being searched in lazy mode. The search resumes from production j, split k. */
+  struct Goal {
+    int nt, i, l, j, k;
+    value_type acc;
+    Grammar::class_mask classes;
+  };
+  std::vector<Goal> goals; // stack of entries being searched, innermost last
+  ColorSet **col_table;    // the coloring table
+  ColorSet full_colors;    // bounded mode: the coloring of the whole input, see colorize_bounded
+  ColorSet no_colors;      // bounded mode: the coloring of spans longer than max_span (other than the whole input)
+  Score **score_table;     // the color score table
+  std::set<int> ignored;   // set of ignored symbols
+  Grammar &grammar;        // A binary grammar in CNF form
+  bool owns_grammar;       // whether the destructor deletes grammar (false for the parts of a SegmentedCYK)
+
+  BasicCYK(BasicCYK &base);                                            // see fork
+  void own_row(int nt, int i);                                         // fork: copy a borrowed row before writing it
+  void own_all();                                                      // fork: stop borrowing from the base
+  void parse_fork();                                                   // fork: recompute entries that depend on changes
+  value_type match(int nt, int i, int l);                              // compute one element of the CYK table
+  bool derive(int nt, int j, int i, int k, int l, value_type &acc, Grammar::class_mask &classes); // one step of match
+  void compute(int nt, int i, int l);                                  // set one element of the CYK table, unless known
+  bool is_known(int nt, int i, int l);                                 // lazy mode: is the entry final
+  void evaluate(int nt, int i, int l);                                 // lazy mode: compute an entry on demand
+  bool push_goal(int nt, int i, int l);                                // lazy mode: start searching an entry
+  bool advance(Goal &g, int &nt, int &i, int &l);                      // lazy mode: continue searching an entry
+  void prepare();                                                      // restrict each entry to candidate symbols
+  bool is_candidate(int nt, int i, int l);                             // may nt derive entry (i, l)
+  void colorize_bounded();                                             // bounded mode: color the whole input
   void set_color(int i, int l, int nt, int ci, int cl);                // coloring table setter, single color
   void set_colors(int i, int l, ColorSet &colors);                     // coloring table setter, all colors are copied from supplied ColorSet
   Score & get_score(int i, int l);                                     // score table getter
   void set_score(int i, int l, int coverage, int largest, int num);    // score table setter
   void compute_color(int i, int l);                                    // compute one element of the coloring table
   bool is_ignored(int nt);
+  bool poll_cancel();                                                  // stop the current call if the token is set
 
 public:
 
-  CYK(int n, int m, Grammar &g);
-  ~CYK();
+  BasicCYK(int n, int m, Grammar &g, int max_span = 0);
+  BasicCYK(int m, Grammar &g, int max_span = 0);
+  ~BasicCYK();
 
   void set_cyk(int nt, int i, int l);  // CYK table setter
   void unset_cyk(int nt, int i, int l);// CYK table setter
   bool get_cyk(int nt, int i, int l);  // CYK table getter
+  value_type get_value(int nt, int i, int l); // CYK table getter, as a semiring value
   int get_lmax();                      // lmax getter
+  int get_n();                         // n getter
+  int get_m();                         // m getter
   void parse();                        // fill out the CYK table
   int parse_partial(int l);            // fill out the CYK table for only some values of l
+  void parse_lazy();                   // fill out the CYK table on demand, as entries are requested
+  void set_pruning(bool on);           // whether to restrict entries to candidate symbols; call before parsing
+  void add_symbols(int n);             // add empty rows for symbols interned after construction
+  int reparse(Grammar &next);          // switch to a changed grammar, recomputing only the entries that may change
+  BasicCYK *fork();                    // a copy-on-write snapshot of a parsed table
+  uint64_t fingerprint(std::vector<int> *words = nullptr); // content hash of everything but the grammar that a parse depends on
+  bool export_packed(PackedBuffer &out, bool colors); // serialize a parsed table
+  bool load_packed(PackedBuffer &in);  // restore a table serialized by export_packed instead of parsing
   ColorSet & get_colors(int i, int l); // coloring table getter
+  void export_colors(int i, int l, PackedBuffer &out);  // coloring of a span, as [nt i l] triples
+  void export_symbols(int i, int l, PackedBuffer &out); // every nt that derives a span
+  void export_chart(int i, int l, PackedBuffer &out);   // every entry within a span, as [nt i l] triples
   void ignore(int nt);                 // mark the given nt as ignored, and thus excluded from colorings
+  void set_cancel_token(CancelToken *token); // token polled by parse and colorize, or nullptr
+  bool is_cancelled();                 // whether the last parse or colorize stopped early; calling it again resumes
   void colorize();                     // fill out the coloring table
   void init_colorize_partial();        // initialize the coloring table in preparation for colorize_partial
   int colorize_partial(int l);         // fill out the coloring table for only some values of l
+  void recolorize();                   // refresh the coloring table after reparse
   void print_cyk();                    // print the CYK table
   void print_col();                    // print the coloring table
   void print_info();                   // print general statistics
 };
 
+typedef BasicCYK<BooleanSemiring> CYK;
+typedef BasicCYK<CountingSemiring> CountingCYK;
+typedef BasicCYK<MaxScoreSemiring> ScoreCYK;
+
+extern template class BasicCYK<BooleanSemiring>;
+extern template class BasicCYK<CountingSemiring>;
+extern template class BasicCYK<MaxScoreSemiring>;
+
+/** A CYK parse of a token string that is split into segments, e.g., after each top-level separator. Each segment is
+    parsed and colored by its own CYK, in parallel. Spans within one segment, and spans made of whole segments, are
+    answered from the segments; other spans are not derived.
+
+    Stitching the segments back together fails if some segment is not derived in full by a symbol that is not ignored
+    (e.g., because a separator was not at the top level after all). parse then falls back to a single CYK over the
+    whole string, which answers every query from then on. */
+class SegmentedCYK {
+
+  int n;                        // 1 + number of symbols
+  int m;                        // length of token string
+  int num_threads;              // for parallel_for
+  std::vector<int> starts;      // starts[k] is the first token of segment k, and starts.back() == m
+  std::vector<CYK*> segments;   // segments[k] parses tokens starts[k] to starts[k+1]-1
+  CYK *whole;                   // the whole-string parse, only if stitching failed
+  std::vector<int> sets;        // [nt i l] of every set_cyk, replayed into whole
+  std::set<int> ignored;        // set of ignored symbols
+  Grammar &grammar;             // shared by all segments, and owned by this instance
+  CancelToken *cancel_token;    // passed on to the segment parses, and polled between segments (not owned)
+  bool cancelled;               // whether the last parse or colorize was cancelled
+
+  int segment_of(int i);        // index of the segment containing token i
+  bool stitch();                // is every segment derived in full
+
+public:
+
+  SegmentedCYK(int m, Grammar &g, std::vector<int> &segment_starts, int num_threads);
+  ~SegmentedCYK();
+
+  void set_cyk(int nt, int i, int l);      // CYK table setter
+  bool get_cyk(int nt, int i, int l);      // CYK table getter, false for spans across segments while stitched
+  void ignore(int nt);                     // mark the given nt as ignored, and thus excluded from colorings
+  bool parse();                            // parse all segments; false if it fell back to a whole-string parse
+  void colorize();                         // color all segments
+  ColorSet get_colors(int i, int l);       // coloring getter, in whole-string positions
+  void export_colors(int i, int l, PackedBuffer &out); // coloring of a span, as [nt i l] triples
+  int get_num_segments();                  // number of segments, 1 after falling back
+  bool is_stitched();                      // whether queries are answered from the segments
+  void set_cancel_token(CancelToken *token); // make parse and colorize stop early once token is cancelled
+  bool is_cancelled();                     // whether the last parse or colorize stopped early; calling it again resumes
+};
+
+void export_ambiguous_spans(CountingCYK &cyk, PackedBuffer &out);
+
 #endif
@@ -0,0 +1,51 @@
+#include "stats.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Stats
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *STAT_NAMES[NUM_STATS] = {
+  "match-calls",
+  "split-points",
+  "cells-set",
+  "table-bytes",
+  "color-cells",
+  "color-ties",
+  "color-entries",
+  "color-dedupe-hits",
+  "intersect-pairs",
+  "intersect-edges",
+  "prune-vertices-before",
+  "prune-edges-before",
+  "prune-vertices-after",
+  "prune-edges-after",
+  "paths-enumerated",
+};
+
+Stats::counter Stats::counters[NUM_STATS];
+
+bool Stats::enabled() {
+#ifdef PARSIMONY_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Stats::reset() {
+  for (int stat = 0; stat < NUM_STATS; ++stat) {
+    counters[stat] = 0;
+  }
+}
+
+int Stats::size() {
+  return NUM_STATS;
+}
+
+std::string Stats::name(int stat) {
+  return stat >= 0 && stat < NUM_STATS ? STAT_NAMES[stat] : "";
+}
+
+double Stats::get(int stat) {
+  return stat >= 0 && stat < NUM_STATS ? (double)counters[stat] : 0;
+}
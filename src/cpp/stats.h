@@ -0,0 +1,59 @@
+#ifndef _stats_h
+#define _stats_h
+
+#include <string>
+#ifdef PARSIMONY_THREADS
+#include <atomic>
+#endif
+
+/** Counters of the work done on the hot paths of parsing and inference, to tell why a run is slow and not only that it
+    is. Counters are global and accumulate across all instances until Stats::reset.
+
+    Counting is only compiled in with PARSIMONY_STATS. Otherwise STAT_INC and STAT_ADD expand to nothing, and
+    Stats::enabled is false. */
+enum Stat {
+  MATCH_CALLS,            // CYK entries searched for derivations (match, or a lazy-mode goal)
+  SPLIT_POINTS,           // (production, split point) pairs examined by derive
+  CELLS_SET,              // CYK entries found to be derivable
+  TABLE_BYTES,            // bytes allocated for CYK, coloring and grammar tables
+  COLOR_CELLS,            // coloring table entries computed
+  COLOR_TIES,             // split points whose coloring score ties with the best so far
+  COLOR_ENTRIES,          // colors added to ColorSets
+  COLOR_DEDUPE_HITS,      // colors not added to a ColorSet since it already held them
+  INTERSECT_PAIRS,        // vertex pairs expanded by ConstraintState intersection
+  INTERSECT_EDGES,        // edges added to the product by intersection
+  PRUNE_VERTICES_BEFORE,  // vertices before remove_non_solution_nodes
+  PRUNE_EDGES_BEFORE,     // edges before remove_non_solution_nodes
+  PRUNE_VERTICES_AFTER,   // vertices after remove_non_solution_nodes
+  PRUNE_EDGES_AFTER,      // edges after remove_non_solution_nodes
+  PATHS_ENUMERATED,       // shortest paths enumerated into Solutions
+  NUM_STATS
+};
+
+class Stats {
+public:
+
+#ifdef PARSIMONY_THREADS
+  typedef std::atomic<long long> counter;
+#else
+  typedef long long counter;
+#endif
+
+  static counter counters[NUM_STATS];
+
+  static bool enabled();
+  static void reset();
+  static int size();
+  static std::string name(int stat); // e.g., "match-calls"
+  static double get(int stat);       // a double, since counts may not fit in the 32 bits of a JS int
+};
+
+#ifdef PARSIMONY_STATS
+#define STAT_INC(stat) (++Stats::counters[stat])
+#define STAT_ADD(stat, x) (Stats::counters[stat] += (x))
+#else
+#define STAT_INC(stat) do {} while (0)
+#define STAT_ADD(stat, x) do {} while (0)
+#endif
+
+#endif
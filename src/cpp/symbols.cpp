@@ -0,0 +1,73 @@
+#include "symbols.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// SymbolTable
+////////////////////////////////////////////////////////////////////////////////
+
+SymbolTable::SymbolTable() {
+  names.push_back("");
+  terminals.push_back(false);
+}
+
+/* Return the id of name, assigning the next free id if it has not been seen before. */
+int SymbolTable::intern(const std::string &name, bool terminal) {
+  auto found = ids.find(name);
+  if (found != ids.end()) {
+    return found->second;
+  }
+  int id = names.size();
+  ids[name] = id;
+  names.push_back(name);
+  terminals.push_back(terminal);
+  return id;
+}
+
+/* Intern every name in a newline-separated list, in order, so that a batch of new symbols costs a single call from JS.
+   Names starting with % are terminals, following parser/terminal?. Returns the new size(). */
+int SymbolTable::intern_all(const std::string &joined_names) {
+  size_t start = 0;
+  while (start < joined_names.size()) {
+    size_t end = joined_names.find('\n', start);
+    if (end == std::string::npos) {
+      end = joined_names.size();
+    }
+    if (end > start) {
+      intern(joined_names.substr(start, end - start), joined_names[start] == '%');
+    }
+    start = end + 1;
+  }
+  return size();
+}
+
+/* Return the id of name, or 0 if it has not been interned. */
+int SymbolTable::lookup(const std::string &name) {
+  auto found = ids.find(name);
+  return found == ids.end() ? 0 : found->second;
+}
+
+bool SymbolTable::is_terminal(int id) {
+  return id > 0 && id < (int) terminals.size() && terminals[id];
+}
+
+std::string SymbolTable::get_name(int id) {
+  return id > 0 && id < (int) names.size() ? names[id] : "";
+}
+
+/* Return the names of all symbols with ids >= id, newline-separated and in id order. Since ids never change, JS can
+   keep a name array and extend it with this whenever size() grows. */
+std::string SymbolTable::names_from(int id) {
+  std::string result;
+  int first = id < 1 ? 1 : id;
+  for (int k = first; k < (int) names.size(); ++k) {
+    if (k > first) {
+      result += '\n';
+    }
+    result += names[k];
+  }
+  return result;
+}
+
+/* 1 + the number of symbols, which is the n expected by Grammar and CYK. */
+int SymbolTable::size() {
+  return names.size();
+}
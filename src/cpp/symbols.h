@@ -0,0 +1,30 @@
+#ifndef _symbols_h
+#define _symbols_h
+
+#include <map>
+#include <string>
+#include <vector>
+
+/** Assigns stable integer ids to grammar symbols. Ids are handed out incrementally as symbols are first interned, starting
+    at 1 since 0 is reserved as a nil sentinel, and never change afterwards. A single table is meant to outlive many
+    parses and inference runs over the same grammar, so that Grammar, CYK and ConstraintState instances built from it
+    all agree on ids, and JS only has to decode each id once (see names_from). */
+class SymbolTable {
+public:
+
+  std::vector<std::string> names;   // names[id], with names[0] empty
+  std::vector<bool> terminals;      // terminals[id] is true for terminal symbols
+  std::map<std::string, int> ids;
+
+  SymbolTable();
+
+  int intern(const std::string &name, bool terminal);
+  int intern_all(const std::string &joined_names);
+  int lookup(const std::string &name);
+  bool is_terminal(int id);
+  std::string get_name(int id);
+  std::string names_from(int id);
+  int size();
+};
+
+#endif
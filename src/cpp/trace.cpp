@@ -0,0 +1,73 @@
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#ifdef PARSIMONY_THREADS
+#include <atomic>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Trace
+////////////////////////////////////////////////////////////////////////////////
+
+// the ring buffer, only allocated in tracing builds. Event k (counting from the last clear) is in events[k % CAPACITY].
+static std::vector<TraceEvent> events(Trace::enabled() ? Trace::CAPACITY : 0);
+#ifdef PARSIMONY_THREADS
+static std::atomic<long long> num_recorded(0);
+static std::atomic<int> num_threads(0);
+static thread_local int tid = num_threads++;
+#else
+static long long num_recorded = 0;
+static const int tid = 0;
+#endif
+
+double Trace::now() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* With PARSIMONY_THREADS, each event claims its own slot, but export_json must not race with recording. */
+void Trace::record(const char *name, const char *arg, int value, double start, double end) {
+  long long k = num_recorded++;
+  events[k % CAPACITY] = TraceEvent{name, arg, value, tid, start, end - start};
+}
+
+bool Trace::enabled() {
+#ifdef PARSIMONY_TRACE
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Trace::clear() {
+  num_recorded = 0;
+}
+
+int Trace::size() {
+  return num_recorded < CAPACITY ? (int)num_recorded : CAPACITY;
+}
+
+/* The held events, oldest first, as a trace-event JSON object of complete ("X") events. */
+std::string Trace::export_json() {
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  long long end = num_recorded;
+  long long begin = end - size();
+  char buf[128];
+  for (long long k = begin; k < end; ++k) {
+    const TraceEvent &e = events[k % CAPACITY];
+    out += k == begin ? "\n" : ",\n";
+    out += "{\"name\":\"";
+    out += e.name;
+    snprintf(buf, sizeof(buf), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e.tid, e.start, e.duration);
+    out += buf;
+    if (e.arg) {
+      out += ",\"args\":{\"";
+      out += e.arg;
+      snprintf(buf, sizeof(buf), "\":%d}", e.value);
+      out += buf;
+    }
+    out += "}";
+  }
+  out += "\n]}";
+  return out;
+}
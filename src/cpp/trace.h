@@ -0,0 +1,59 @@
+#ifndef _trace_h
+#define _trace_h
+
+#include <string>
+
+/** A low-overhead timeline of the engine's phases, for finding where interactive latency goes. TRACE_SCOPE(name)
+    records the time spent in the rest of the enclosing block as one event, and TRACE_SCOPE_ARG(name, arg, value) also
+    records an int argument, such as the diagonal of a parse. Events go into a fixed-size ring buffer, so only the most
+    recent Trace::CAPACITY are kept, and Trace::export_json returns them as Chrome trace-event JSON (for
+    chrome://tracing or Perfetto).
+
+    Unlike DEBUG_PRINT, an event costs two clock reads and no I/O. Tracing is only compiled in with PARSIMONY_TRACE;
+    otherwise the macros expand to nothing. Names must be string literals, since only the pointers are kept. */
+struct TraceEvent {
+  const char *name;
+  const char *arg;  // name of the argument, or nullptr
+  int value;        // value of the argument
+  int tid;
+  double start;     // microseconds
+  double duration;  // microseconds
+};
+
+class Trace {
+public:
+
+  static const int CAPACITY = 1 << 16;
+
+  static double now();  // microseconds on a monotonic clock
+  static void record(const char *name, const char *arg, int value, double start, double end);
+  static bool enabled();
+  static void clear();
+  static int size();    // number of events held, at most CAPACITY
+  static std::string export_json();
+};
+
+class TraceScope {
+  const char *name;
+  const char *arg;
+  int value;
+  double start;
+
+public:
+
+  TraceScope(const char *name, const char *arg = nullptr, int value = 0):
+    name(name), arg(arg), value(value), start(Trace::now()) {}
+  ~TraceScope() { Trace::record(name, arg, value, start, Trace::now()); }
+};
+
+#ifdef PARSIMONY_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg, value) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg, value)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_SCOPE_ARG(name, arg, value) do {} while (0)
+#endif
+
+#endif
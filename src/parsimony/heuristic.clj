@@ -1,9 +1,11 @@
 (ns parsimony.heuristic)
 
 (defmacro with-cljs-query [& body]
-  `(binding [*run-query-fn* run-cljs-query]
+  `(binding [*run-query-fn* run-cljs-query
+             *run-queries-fn* run-cljs-queries]
      ~@body))
 
 (defmacro with-cpp-query [& body]
-  `(binding [*run-query-fn* run-cpp-query]
+  `(binding [*run-query-fn* run-cpp-query
+             *run-queries-fn* run-cpp-queries]
      ~@body))